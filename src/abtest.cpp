@@ -0,0 +1,327 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "abtest.h"
+#include "convarhelper.h"
+
+#define SSF_AB_MAX_CONFIGS		8
+
+// Engine cvar, NULL if the game has no parallel sendsnapshot switch
+extern ConVar *g_pSvParallelSendSnapshot;
+
+ConVar *g_SvSSFDetourWriteTempEntities = CreateConVar("sv_ssf_detour_writetempentities", "1", FCVAR_NOTIFY, "Enable the WriteTempEntities detour (locking, temp entity budget and stats). Disabling it brings back the parallel sendsnapshot crash, testing only.");
+ConVar *g_SvSSFDetourReleaseReference = CreateConVar("sv_ssf_detour_releasereference", "1", FCVAR_NOTIFY, "Enable the ReleaseReference detour. Disabling it brings back the parallel sendsnapshot crash, testing only.");
+ConVar *g_SvSSFDetourCreateEmptySnapshot = CreateConVar("sv_ssf_detour_createemptysnapshot", "1", FCVAR_NOTIFY, "Enable the CreateEmptySnapshot detour. Disabling it brings back the parallel sendsnapshot crash, testing only.");
+ConVar *g_SvSSFLockMode = CreateConVar("sv_ssf_lock_mode", "0", FCVAR_NOTIFY, "Snapshot lock strategy. 0 = spin (CThreadFastMutex), 1 = blocking (CThreadMutex).");
+ConVar *g_SvSSFABInterval = CreateConVar("sv_ssf_ab_interval", "0", FCVAR_NOTIFY, "Rotate through sv_ssf_ab_configs every this many seconds and log frame time stats per configuration. 0 = disabled.");
+ConVar *g_SvSSFABConfigs = CreateConVar("sv_ssf_ab_configs", "1110 1111", FCVAR_NOTIFY, "Space separated configurations for the A/B rotation. Each one is the WriteTempEntities, ReleaseReference and CreateEmptySnapshot detour states followed by the lock mode, e.g. \"1110\".");
+
+struct SSFFrameStats
+{
+	int		nFrames;
+	double	flFrameSum;
+	double	flFrameSumSq;
+	double	flFrameMax;
+	int		nSnapshotFrames;	/**< Frames with a snapshot phase time */
+	double	flSnapshotSum;
+	double	flSnapshotSumSq;
+	double	flSnapshotMax;
+};
+
+struct SSFConfigStats
+{
+	SSFConfig		config;
+	SSFFrameStats	total;		/**< Since the stats were reset */
+	SSFFrameStats	window;		/**< Current rotation window */
+};
+
+static SSFConfigStats s_Stats[SSF_AB_MAX_CONFIGS];
+static int s_nStats = 0;
+
+static int s_iABIndex = -1;
+static double s_flABNextSwitch = 0.0;
+static bool s_bRefusing = false;
+
+static void FormatConfig(const SSFConfig &config, char *buffer, size_t maxlength)
+{
+	snprintf(buffer, maxlength, "%d%d%d%d",
+		config.bDetours[SSFDetour_WriteTempEntities] ? 1 : 0,
+		config.bDetours[SSFDetour_ReleaseReference] ? 1 : 0,
+		config.bDetours[SSFDetour_CreateEmptySnapshot] ? 1 : 0,
+		(int)config.iLockMode);
+}
+
+static bool ParseConfig(const char *str, size_t len, SSFConfig &config)
+{
+	if (len != SSFDetour_Count + 1)
+		return false;
+
+	for (int i = 0; i < SSFDetour_Count; i++)
+	{
+		if (str[i] != '0' && str[i] != '1')
+			return false;
+
+		config.bDetours[i] = str[i] == '1';
+	}
+
+	int mode = str[SSFDetour_Count] - '0';
+	if (mode < 0 || mode >= SSFLockMode_Count)
+		return false;
+
+	config.iLockMode = (SSFLockMode)mode;
+	return true;
+}
+
+static int ParseConfigList(const char *str, SSFConfig *configs, int maxconfigs)
+{
+	int count = 0;
+
+	while (*str && count < maxconfigs)
+	{
+		while (*str == ' ')
+			str++;
+
+		const char *end = str;
+		while (*end && *end != ' ')
+			end++;
+
+		if (end != str && ParseConfig(str, end - str, configs[count]))
+			count++;
+
+		str = end;
+	}
+
+	return count;
+}
+
+static void GetCvarConfig(SSFConfig &config)
+{
+	config.bDetours[SSFDetour_WriteTempEntities] = g_SvSSFDetourWriteTempEntities->GetBool();
+	config.bDetours[SSFDetour_ReleaseReference] = g_SvSSFDetourReleaseReference->GetBool();
+	config.bDetours[SSFDetour_CreateEmptySnapshot] = g_SvSSFDetourCreateEmptySnapshot->GetBool();
+
+	int mode = g_SvSSFLockMode->GetInt();
+	config.iLockMode = (mode < 0 || mode >= SSFLockMode_Count) ? SSFLockMode_Spin : (SSFLockMode)mode;
+}
+
+// Every lock detour is needed while the snapshots are sent in parallel,
+// see https://bugbait.valvesoftware.com/show_bug.cgi?id=53403
+static bool IsSafeConfig(const SSFConfig &config)
+{
+	if (!g_pSvParallelSendSnapshot || !g_pSvParallelSendSnapshot->GetBool())
+		return true;
+
+	for (int i = 0; i < SSFDetour_Count; i++)
+	{
+		if (!config.bDetours[i])
+			return false;
+	}
+
+	return true;
+}
+
+// Drops the configurations that are unsafe right now
+static int FilterConfigs(SSFConfig *configs, int count, bool &bRefused)
+{
+	int kept = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (IsSafeConfig(configs[i]))
+			configs[kept++] = configs[i];
+		else
+			bRefused = true;
+	}
+
+	return kept;
+}
+
+static SSFConfigStats *GetStats(const SSFConfig &config)
+{
+	for (int i = 0; i < s_nStats; i++)
+	{
+		if (s_Stats[i].config == config)
+			return &s_Stats[i];
+	}
+
+	if (s_nStats >= SSF_AB_MAX_CONFIGS)
+		return NULL;
+
+	SSFConfigStats *stats = &s_Stats[s_nStats++];
+	memset(stats, 0, sizeof(*stats));
+	stats->config = config;
+	return stats;
+}
+
+static void AccumulateFrame(SSFFrameStats &stats, double frameTime, double snapshotTime)
+{
+	stats.nFrames++;
+	stats.flFrameSum += frameTime;
+	stats.flFrameSumSq += frameTime * frameTime;
+	if (frameTime > stats.flFrameMax)
+		stats.flFrameMax = frameTime;
+
+	if (snapshotTime < 0.0)
+		return;
+
+	stats.nSnapshotFrames++;
+	stats.flSnapshotSum += snapshotTime;
+	stats.flSnapshotSumSq += snapshotTime * snapshotTime;
+	if (snapshotTime > stats.flSnapshotMax)
+		stats.flSnapshotMax = snapshotTime;
+}
+
+static void FormatStats(const SSFFrameStats &stats, char *buffer, size_t maxlength)
+{
+	if (!stats.nFrames)
+	{
+		snprintf(buffer, maxlength, "no frames");
+		return;
+	}
+
+	double frameMean = stats.flFrameSum / stats.nFrames;
+	double frameDev = sqrt(fmax(0.0, stats.flFrameSumSq / stats.nFrames - frameMean * frameMean));
+
+	// The snapshot phase is timed from SV_ComputeClientPacks to the last SendSnapshot
+	if (!stats.nSnapshotFrames)
+	{
+		snprintf(buffer, maxlength, "%d frames, frame %.3f ms (sd %.3f, max %.3f), snapshot n/a (SV_ComputeClientPacks or SendSnapshot detour missing)",
+			stats.nFrames,
+			frameMean * 1000.0, frameDev * 1000.0, stats.flFrameMax * 1000.0);
+		return;
+	}
+
+	double snapMean = stats.flSnapshotSum / stats.nSnapshotFrames;
+	double snapDev = sqrt(fmax(0.0, stats.flSnapshotSumSq / stats.nSnapshotFrames - snapMean * snapMean));
+
+	snprintf(buffer, maxlength, "%d frames, frame %.3f ms (sd %.3f, max %.3f), snapshot phase %.3f ms (sd %.3f, max %.3f)",
+		stats.nFrames,
+		frameMean * 1000.0, frameDev * 1000.0, stats.flFrameMax * 1000.0,
+		snapMean * 1000.0, snapDev * 1000.0, stats.flSnapshotMax * 1000.0);
+}
+
+// The cvar configuration with every lock detour on if it is refused
+static void GetSafeCvarConfig(SSFConfig &config, bool &bRefused)
+{
+	GetCvarConfig(config);
+
+	if (!FilterConfigs(&config, 1, bRefused))
+	{
+		for (int i = 0; i < SSFDetour_Count; i++)
+			config.bDetours[i] = true;
+	}
+}
+
+static bool SelectConfig(double now, SSFConfig &config, bool &bRefused)
+{
+	float interval = g_SvSSFABInterval->GetFloat();
+	if (interval <= 0.0f)
+	{
+		s_iABIndex = -1;
+		GetSafeCvarConfig(config, bRefused);
+		return false;
+	}
+
+	SSFConfig configs[SSF_AB_MAX_CONFIGS];
+	int count = ParseConfigList(g_SvSSFABConfigs->GetString(), configs, SSF_AB_MAX_CONFIGS);
+	count = FilterConfigs(configs, count, bRefused);
+	if (!count)
+	{
+		s_iABIndex = -1;
+		GetSafeCvarConfig(config, bRefused);
+		return false;
+	}
+
+	if (s_iABIndex < 0 || s_iABIndex >= count || now >= s_flABNextSwitch)
+	{
+		if (s_iABIndex >= 0 && s_iABIndex < count)
+		{
+			SSFConfigStats *stats = GetStats(configs[s_iABIndex]);
+			if (stats)
+			{
+				char name[16], line[256];
+				FormatConfig(stats->config, name, sizeof(name));
+				FormatStats(stats->window, line, sizeof(line));
+				g_pSM->LogMessage(myself, "A/B config %s: %s", name, line);
+
+				memset(&stats->window, 0, sizeof(stats->window));
+			}
+		}
+
+		s_iABIndex = (s_iABIndex + 1) % count;
+		s_flABNextSwitch = now + interval;
+	}
+
+	config = configs[s_iABIndex];
+	return true;
+}
+
+bool SSF_SelectConfig(double now, SSFConfig &config)
+{
+	bool bRefused = false;
+	bool bRotation = SelectConfig(now, config, bRefused);
+
+	if (bRefused && !s_bRefusing)
+		g_pSM->LogError(myself, "Configurations disabling a snapshot lock detour are refused while sv_parallel_sendsnapshot is 1.");
+
+	s_bRefusing = bRefused;
+	return bRotation;
+}
+
+void SSF_RecordFrame(const SSFConfig &config, double frameTime, double snapshotTime)
+{
+	SSFConfigStats *stats = GetStats(config);
+	if (!stats)
+		return;
+
+	AccumulateFrame(stats->total, frameTime, snapshotTime);
+	AccumulateFrame(stats->window, frameTime, snapshotTime);
+}
+
+void SSF_ResetABTest()
+{
+	s_nStats = 0;
+	s_iABIndex = -1;
+	s_flABNextSwitch = 0.0;
+}
+
+CON_COMMAND(sm_ssf_ab_report, "Prints frame time stats for every detour/lock configuration the A/B rotation used so far.")
+{
+	if (!s_nStats)
+	{
+		META_CONPRINT("No configuration stats yet.\n");
+		return;
+	}
+
+	for (int i = 0; i < s_nStats; i++)
+	{
+		char name[16], line[256];
+		FormatConfig(s_Stats[i].config, name, sizeof(name));
+		FormatStats(s_Stats[i].total, line, sizeof(line));
+		META_CONPRINTF("%s: %s\n", name, line);
+	}
+}
+
+CON_COMMAND(sm_ssf_ab_reset, "Clears the frame time stats of every detour/lock configuration.")
+{
+	SSF_ResetABTest();
+	META_CONPRINT("Configuration stats cleared.\n");
+}
@@ -0,0 +1,81 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _INCLUDE_SSF_ABTEST_H_
+#define _INCLUDE_SSF_ABTEST_H_
+
+/**
+ * @file abtest.h
+ * @brief Runtime detour/lock configuration and automatic A/B rotation.
+ *
+ * The requested configuration comes either from the sv_ssf_detour_* and
+ * sv_ssf_lock_mode cvars, or from the sv_ssf_ab_configs rotation when
+ * sv_ssf_ab_interval is set. The extension applies it from the game frame
+ * hook, where no sendsnapshot worker is running. While sv_parallel_sendsnapshot
+ * is 1, configurations disabling one of the lock detours are refused.
+ */
+
+#include "extension.h"
+#include "ssflock.h"
+
+struct SSFConfig
+{
+	bool		bDetours[SSFDetour_Count];
+	SSFLockMode	iLockMode;
+
+	bool operator==(const SSFConfig &other) const
+	{
+		for (int i = 0; i < SSFDetour_Count; i++)
+		{
+			if (bDetours[i] != other.bDetours[i])
+				return false;
+		}
+		return iLockMode == other.iLockMode;
+	}
+
+	bool operator!=(const SSFConfig &other) const
+	{
+		return !(*this == other);
+	}
+};
+
+/**
+ * @brief Returns the configuration that should be active this frame.
+ *
+ * @param now		Current time in seconds.
+ * @param config	Receives the configuration.
+ * @return			True if the A/B rotation picked it, false if it comes from the cvars.
+ */
+bool SSF_SelectConfig(double now, SSFConfig &config);
+
+/**
+ * @brief Accounts one frame of the A/B rotation to the active configuration.
+ *
+ * @param config		Active configuration.
+ * @param frameTime		Time since the previous frame hook, in seconds.
+ * @param snapshotTime	Time from SV_ComputeClientPacks to the last SendSnapshot, in seconds, -1 if unknown.
+ */
+void SSF_RecordFrame(const SSFConfig &config, double frameTime, double snapshotTime);
+
+/**
+ * @brief Clears the A/B statistics and rotation state.
+ */
+void SSF_ResetABTest();
+
+#endif // _INCLUDE_SSF_ABTEST_H_
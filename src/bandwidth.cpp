@@ -0,0 +1,382 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <string.h>
+
+#include "bandwidth.h"
+#include "clientstate.h"
+#include "tempents.h"
+#include "convarhelper.h"
+#include "sounds.h"
+#include <server_class.h>
+
+struct SSFBandwidthSample
+{
+	int		tick;
+	int		bits;
+};
+
+// Written by the worker sending to the client, read on the main thread between frames
+struct SSFClientBandwidth
+{
+	SSFBandwidthSample	tempEnts[SSF_BW_WINDOW];
+	SSFBandwidthSample	sounds[SSF_BW_WINDOW];
+};
+
+// Temp entity class or sound, folded into the window once per tick
+struct SSFEventBandwidth
+{
+	const char				*name;			// temp entity classes only
+	std::atomic<uint32_t>	nTickBits;		// current tick, all workers
+	std::atomic<uint32_t>	nTickEvents;
+	uint64_t				nTotalBits;		// main thread
+	uint64_t				nTotalEvents;
+	SSFBandwidthSample		window[SSF_BW_WINDOW];
+};
+
+struct SSFPercentiles
+{
+	int		samples;
+	double	mean;
+	int		p50;
+	int		p95;
+	int		p99;
+	int		max;
+};
+
+ConVar *g_SvSSFBandwidth = CreateConVar("sv_ssf_bandwidth", "0", FCVAR_NOTIFY, "Account temp entity and sound bits per client and per event type, see sm_ssf_bandwidth.");
+
+volatile bool g_bSSFBandwidth = false;
+
+static SSFClientBandwidth s_Clients[SSF_MAXCLIENTS + 1];
+static SSFEventBandwidth s_Classes[SSF_BW_MAX_CLASSES];
+static SSFEventBandwidth s_Sounds[SSF_BW_MAX_SOUNDS];
+static int s_iLastTick = 0;
+
+static void RecordClassBits(int classID, int bits, const ServerClass *pClass)
+{
+	if (classID < 0 || classID >= SSF_BW_MAX_CLASSES)
+		return;
+
+	SSFEventBandwidth &stats = s_Classes[classID];
+	if (!stats.name && pClass)
+		stats.name = pClass->m_pNetworkName;
+
+	stats.nTickBits.fetch_add(bits, std::memory_order_relaxed);
+	stats.nTickEvents.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SSF_BW_RecordTempEnts(int client, int tick, int bits, CFrameSnapshot *pSnapshot, int ev_max)
+{
+	if (client < 1 || client > SSF_MAXCLIENTS)
+		return;
+
+	SSFBandwidthSample &sample = s_Clients[client].tempEnts[tick & (SSF_BW_WINDOW - 1)];
+	sample.tick = tick;
+	sample.bits = bits;
+
+	if (SSF_IsTempEntTableFor(pSnapshot))
+	{
+		const SSFTempEntTable &table = g_TempEntTable;
+		uint64_t selected[SSF_TE_EVENT_WORDS];
+		SSF_SelectTempEnts(client, selected);
+
+		for (int i = 0; i < table.count && ev_max > 0; i++)
+		{
+			if (!((selected[i >> 6] >> (i & 63)) & 1))
+				continue;
+
+			ev_max--;
+			RecordClassBits(table.classID[i], table.bits[i], table.pClass[i]);
+		}
+		return;
+	}
+
+	CEventInfo **pEvents;
+	int count = SSF_GetSnapshotTempEnts(pSnapshot, pEvents);
+
+	for (int i = 0; i < count && ev_max > 0; i++)
+	{
+		CEventInfo *pEvent = pEvents[i];
+		if (!pEvent || !SSF_TempEntIncludesClient(pEvent, client))
+			continue;
+
+		ev_max--;
+		RecordClassBits(pEvent->classID, pEvent->bits, pEvent->pClientClass);
+	}
+}
+
+void SSF_BW_RecordSounds(int client, int tick, int bits)
+{
+	if (client < 1 || client > SSF_MAXCLIENTS)
+		return;
+
+	SSFBandwidthSample &sample = s_Clients[client].sounds[tick & (SSF_BW_WINDOW - 1)];
+	sample.tick = tick;
+	sample.bits = bits;
+}
+
+void SSF_BW_RecordSound(int soundnum, int bits)
+{
+	if (soundnum < 0 || soundnum >= SSF_BW_MAX_SOUNDS)
+		return;
+
+	s_Sounds[soundnum].nTickBits.fetch_add(bits, std::memory_order_relaxed);
+	s_Sounds[soundnum].nTickEvents.fetch_add(1, std::memory_order_relaxed);
+}
+
+// No worker runs between two send phases
+static void FoldTick(SSFEventBandwidth *stats, int count, int tick)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (!stats[i].nTickEvents.load(std::memory_order_relaxed))
+			continue;
+
+		uint32_t bits = stats[i].nTickBits.exchange(0, std::memory_order_relaxed);
+		uint32_t events = stats[i].nTickEvents.exchange(0, std::memory_order_relaxed);
+
+		stats[i].nTotalBits += bits;
+		stats[i].nTotalEvents += events;
+
+		SSFBandwidthSample &sample = stats[i].window[tick & (SSF_BW_WINDOW - 1)];
+		sample.tick = tick;
+		sample.bits = bits;
+	}
+}
+
+static void ResetEvents(SSFEventBandwidth *stats, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		stats[i].nTickBits.store(0, std::memory_order_relaxed);
+		stats[i].nTickEvents.store(0, std::memory_order_relaxed);
+
+		// Never sampled, the window of unused sounds stays untouched
+		if (!stats[i].nTotalEvents)
+			continue;
+
+		stats[i].nTotalBits = 0;
+		stats[i].nTotalEvents = 0;
+		memset(stats[i].window, 0, sizeof(stats[i].window));
+	}
+}
+
+void SSF_BW_Frame(int tick)
+{
+	g_bSSFBandwidth = g_SvSSFBandwidth->GetBool();
+	s_iLastTick = tick;
+
+	FoldTick(s_Classes, SSF_BW_MAX_CLASSES, tick);
+	FoldTick(s_Sounds, SSF_BW_MAX_SOUNDS, tick);
+}
+
+void SSF_BW_ResetClient(int client)
+{
+	memset(&s_Clients[client], 0, sizeof(s_Clients[client]));
+}
+
+// Main thread only, like the frame hook
+static void ResetAll()
+{
+	for (int client = 1; client <= SSF_MAXCLIENTS; client++)
+		SSF_BW_ResetClient(client);
+
+	ResetEvents(s_Classes, SSF_BW_MAX_CLASSES);
+	ResetEvents(s_Sounds, SSF_BW_MAX_SOUNDS);
+
+	g_TempEntTableStats.nCalls.store(0, std::memory_order_relaxed);
+	g_TempEntTableStats.nSkipped.store(0, std::memory_order_relaxed);
+	g_TempEntTableStats.nUntabled.store(0, std::memory_order_relaxed);
+}
+
+static void ComputePercentiles(const SSFBandwidthSample *window, int tick, SSFPercentiles &result)
+{
+	int values[SSF_BW_WINDOW];
+	int count = 0;
+	double sum = 0.0;
+
+	for (int i = 0; i < SSF_BW_WINDOW; i++)
+	{
+		if (window[i].tick <= 0 || window[i].tick > tick || tick - window[i].tick >= SSF_BW_WINDOW)
+			continue;
+
+		values[count++] = window[i].bits;
+		sum += window[i].bits;
+	}
+
+	memset(&result, 0, sizeof(result));
+	result.samples = count;
+	if (!count)
+		return;
+
+	std::sort(values, values + count);
+
+	result.mean = sum / count;
+	result.p50 = values[(count - 1) * 50 / 100];
+	result.p95 = values[(count - 1) * 95 / 100];
+	result.p99 = values[(count - 1) * 99 / 100];
+	result.max = values[count - 1];
+}
+
+struct SSFRankedEntry
+{
+	int		index;
+	double	value;
+
+	bool operator<(const SSFRankedEntry &other) const
+	{
+		return value > other.value;
+	}
+};
+
+CON_COMMAND(sm_ssf_bandwidth, "sm_ssf_bandwidth [count|reset] - Prints the top temp entity and sound consumers over the last ticks, or clears the samples and totals.")
+{
+	if (args.ArgC() > 1 && !strcmp(args.Arg(1), "reset"))
+	{
+		ResetAll();
+		META_CONPRINT("Bandwidth samples, totals and temp entity table counters cleared.\n");
+		return;
+	}
+
+	uint32_t nTableCalls = g_TempEntTableStats.nCalls.load(std::memory_order_relaxed);
+	if (nTableCalls)
+	{
+		META_CONPRINTF("Temp entity table: %u of %u WriteTempEntities calls skipped, %u without a matching table.\n",
+			g_TempEntTableStats.nSkipped.load(std::memory_order_relaxed), nTableCalls,
+			g_TempEntTableStats.nUntabled.load(std::memory_order_relaxed));
+	}
+	else
+	{
+		META_CONPRINT("Temp entity table: no calls, sv_ssf_tempent_table is 0 or the SV_ComputeClientPacks detour is unavailable.\n");
+	}
+
+	if (!g_bSSFBandwidth)
+	{
+		META_CONPRINT("Bandwidth accounting is disabled, set sv_ssf_bandwidth 1.\n");
+		return;
+	}
+
+	int top = args.ArgC() > 1 ? atoi(args.Arg(1)) : 10;
+	if (top <= 0)
+		top = 10;
+
+	int tick = s_iLastTick;
+	static SSFRankedEntry ranked[SSF_BW_MAX_SOUNDS];
+	int count = 0;
+
+	// Clients by mean bits per tick
+	SSFPercentiles tempEnts[SSF_MAXCLIENTS + 1], sounds[SSF_MAXCLIENTS + 1];
+	for (int client = 1; client <= SSF_MAXCLIENTS; client++)
+	{
+		ComputePercentiles(s_Clients[client].tempEnts, tick, tempEnts[client]);
+		ComputePercentiles(s_Clients[client].sounds, tick, sounds[client]);
+
+		if (!tempEnts[client].samples && !sounds[client].samples)
+			continue;
+
+		ranked[count].index = client;
+		ranked[count].value = tempEnts[client].mean + sounds[client].mean;
+		count++;
+	}
+	std::sort(ranked, ranked + count);
+
+	META_CONPRINTF("Clients, bits per tick over the last %d ticks (mean p50/p95/p99/max):\n", SSF_BW_WINDOW);
+	for (int i = 0; i < count && i < top; i++)
+	{
+		int client = ranked[i].index;
+		IGamePlayer *pPlayer = playerhelpers->GetGamePlayer(client);
+		const SSFPercentiles &te = tempEnts[client];
+		const SSFPercentiles &snd = sounds[client];
+
+		META_CONPRINTF("  %2d %-24s temp entities %7.1f %d/%d/%d/%d, sounds %7.1f %d/%d/%d/%d\n",
+			client, (pPlayer && pPlayer->IsConnected()) ? pPlayer->GetName() : "<disconnected>",
+			te.mean, te.p50, te.p95, te.p99, te.max,
+			snd.mean, snd.p50, snd.p95, snd.p99, snd.max);
+	}
+
+	// Temp entity classes by bits over the window
+	SSFPercentiles classes[SSF_BW_MAX_CLASSES];
+	count = 0;
+	for (int i = 0; i < SSF_BW_MAX_CLASSES; i++)
+	{
+		if (!s_Classes[i].nTotalEvents)
+			continue;
+
+		ComputePercentiles(s_Classes[i].window, tick, classes[i]);
+		if (!classes[i].samples)
+			continue;
+
+		ranked[count].index = i;
+		ranked[count].value = classes[i].mean * classes[i].samples;
+		count++;
+	}
+	std::sort(ranked, ranked + count);
+
+	META_CONPRINT("Temp entity classes, estimated bits per tick with events (mean p50/p95/p99/max).\n"
+		"Only the current snapshot is walked, events of ticks a client missed are under-counted:\n");
+	for (int i = 0; i < count && i < top; i++)
+	{
+		const SSFEventBandwidth &stats = s_Classes[ranked[i].index];
+		const SSFPercentiles &p = classes[ranked[i].index];
+
+		META_CONPRINTF("  %-32s %8.1f %d/%d/%d/%d, %.1f bits/event, %llu events total\n",
+			stats.name ? stats.name : "<unknown>",
+			p.mean, p.p50, p.p95, p.p99, p.max,
+			(double)stats.nTotalBits / stats.nTotalEvents, (unsigned long long)stats.nTotalEvents);
+	}
+
+	// Sounds by bits over the window
+	static SSFPercentiles soundStats[SSF_BW_MAX_SOUNDS];
+	count = 0;
+	for (int i = 0; i < SSF_BW_MAX_SOUNDS; i++)
+	{
+		if (!s_Sounds[i].nTotalEvents)
+			continue;
+
+		ComputePercentiles(s_Sounds[i].window, tick, soundStats[i]);
+		if (!soundStats[i].samples)
+			continue;
+
+		ranked[count].index = i;
+		ranked[count].value = soundStats[i].mean * soundStats[i].samples;
+		count++;
+	}
+	std::sort(ranked, ranked + count);
+
+	if (!g_bSSFSoundDetour)
+	{
+		META_CONPRINT("Sounds are not accounted, the FillSoundsMessage detour is unavailable.\n");
+	}
+	else if (count)
+	{
+		META_CONPRINT("Sounds, bits per tick with the sound, without message headers (mean p50/p95/p99/max):\n");
+	}
+	for (int i = 0; i < count && i < top; i++)
+	{
+		const SSFEventBandwidth &stats = s_Sounds[ranked[i].index];
+		const SSFPercentiles &p = soundStats[ranked[i].index];
+
+		META_CONPRINTF("  sound %5d %8.1f %d/%d/%d/%d, %.1f bits/sound, %llu sent total\n",
+			ranked[i].index, p.mean, p.p50, p.p95, p.p99, p.max,
+			(double)stats.nTotalBits / stats.nTotalEvents, (unsigned long long)stats.nTotalEvents);
+	}
+}
@@ -0,0 +1,80 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _INCLUDE_SSF_BANDWIDTH_H_
+#define _INCLUDE_SSF_BANDWIDTH_H_
+
+/**
+ * @file bandwidth.h
+ * @brief Temp entity and sound bandwidth accounting behind sv_ssf_bandwidth.
+ *
+ * Per-client totals are the exact number of bits written to the snapshot,
+ * sounds exclude the SVC_Sounds header and need the FillSoundsMessage detour.
+ * The per temp entity class breakdown is estimated from the packed size of
+ * each event of the current snapshot the client was eligible for, capped to
+ * its temp entity budget. Clients that missed ticks also receive the events
+ * of the snapshots in between, those are not in the estimate.
+ * Samples are kept for the last SSF_BW_WINDOW ticks, the sm_ssf_bandwidth
+ * console command prints the top clients, temp entity classes and sounds with
+ * rolling percentiles. sm_ssf_bandwidth reset clears the samples and totals.
+ */
+
+class CFrameSnapshot;
+
+#define SSF_BW_WINDOW			256		// ticks, must be a power of two
+#define SSF_BW_MAX_CLASSES		512		// 1 << MAX_SERVER_CLASS_BITS
+#define SSF_BW_MAX_SOUNDS		8192	// MAX_SOUNDS
+
+/**
+ * @brief Accounting switch, refreshed by SSF_BW_Frame().
+ */
+extern volatile bool g_bSSFBandwidth;
+
+/**
+ * @brief Records the temp entities written for a client this tick.
+ *
+ * @param client		Client index.
+ * @param tick			Server tick.
+ * @param bits			Bits written by WriteTempEntities.
+ * @param pSnapshot		Current snapshot, used for the per-class estimate.
+ * @param ev_max		Temp entity budget of the client.
+ */
+void SSF_BW_RecordTempEnts(int client, int tick, int bits, CFrameSnapshot *pSnapshot, int ev_max);
+
+/**
+ * @brief Records the sound data written for a client this tick, without the message header.
+ */
+void SSF_BW_RecordSounds(int client, int tick, int bits);
+
+/**
+ * @brief Records a single delta-encoded sound.
+ */
+void SSF_BW_RecordSound(int soundnum, int bits);
+
+/**
+ * @brief Folds the per-class counters of the last tick into the rolling window. Main thread only.
+ */
+void SSF_BW_Frame(int tick);
+
+/**
+ * @brief Clears the samples of a client.
+ */
+void SSF_BW_ResetClient(int client);
+
+#endif // _INCLUDE_SSF_BANDWIDTH_H_
@@ -0,0 +1,164 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "botpath.h"
+#include "ssflock.h"
+#include "tempents.h"
+#include "sounds.h"
+#include <atomic>
+#include <iclient.h>
+#include <threadtools.h>
+
+extern CGlobalVars *gpGlobals;
+extern SSFLock m_FrameSnapshotsWriteMutex;
+
+enum
+{
+	BOTPATH_UNKNOWN = 0,
+	BOTPATH_VERIFIED,
+	BOTPATH_MISMATCH,
+};
+
+static int s_iDeltaTickOffset = -1;				// CBaseClient::m_nDeltaTick
+static int s_iStringTableAckTickOffset = -1;	// CBaseClient::m_nStringTableAckTick
+static int s_iLastSnapshotOffset = -1;			// CBaseClient::m_pLastSnapshot, CSmartPtr<CFrameSnapshot>
+
+// Linux member functions take this as their first argument. ReleaseReference
+// enters its detour and takes the snapshot lock like any engine call.
+typedef void (*SnapshotReferenceFn)(CFrameSnapshot *);
+static SnapshotReferenceFn s_pAddReference = NULL;
+static SnapshotReferenceFn s_pReleaseReference = NULL;
+
+static std::atomic<int> s_nState(BOTPATH_UNKNOWN);
+static std::atomic<int> s_nChecks(0);
+static bool s_bStateLogged = false;
+
+// Only written from SV_ComputeClientPacks before the workers start
+static CFrameSnapshot *s_pTickSnapshot = NULL;
+static int s_nSnapshotTick = -1;
+static int s_nServerTick = -1;
+
+template <typename T>
+static inline T &GetClientField(IClient *client, int offset)
+{
+	return *reinterpret_cast<T *>(reinterpret_cast<unsigned char *>(client) + offset);
+}
+
+bool SSF_InitBotPath(IGameConfig *pGameConf)
+{
+	void *pAddReference = NULL;
+	void *pReleaseReference = NULL;
+
+	if (!pGameConf->GetOffset("CBaseClient::m_nDeltaTick", &s_iDeltaTickOffset)
+		|| !pGameConf->GetOffset("CBaseClient::m_nStringTableAckTick", &s_iStringTableAckTickOffset)
+		|| !pGameConf->GetOffset("CBaseClient::m_pLastSnapshot", &s_iLastSnapshotOffset)
+		|| !pGameConf->GetMemSig("CFrameSnapshot__AddReference", &pAddReference) || !pAddReference
+		|| !pGameConf->GetMemSig("CFrameSnapshot__ReleaseReference", &pReleaseReference) || !pReleaseReference)
+	{
+		// Already reported by the caller
+		s_nState.store(BOTPATH_MISMATCH, std::memory_order_relaxed);
+		s_bStateLogged = true;
+		return false;
+	}
+
+	s_pAddReference = reinterpret_cast<SnapshotReferenceFn>(pAddReference);
+	s_pReleaseReference = reinterpret_cast<SnapshotReferenceFn>(pReleaseReference);
+
+	return true;
+}
+
+void SSF_SetBotPathSnapshot(CFrameSnapshot *pSnapshot)
+{
+	s_nSnapshotTick = SSF_GetSnapshotTick(pSnapshot);
+	s_pTickSnapshot = s_nSnapshotTick >= 0 ? pSnapshot : NULL;
+	s_nServerTick = gpGlobals->tickcount;
+}
+
+bool SSF_SkipBotSnapshot(IClient *client, SSFBotSnapshotCheck &check)
+{
+	check.bCheck = false;
+
+	int nState = s_nState.load(std::memory_order_acquire);
+	if (nState == BOTPATH_MISMATCH)
+		return false;
+
+	// Sent outside SV_SendClientMessages, the frame may not hold the tick snapshot
+	CFrameSnapshot *pSnapshot = s_pTickSnapshot;
+	if (!pSnapshot || s_nServerTick != gpGlobals->tickcount)
+		return false;
+
+	// The engine never sends the same snapshot twice
+	CFrameSnapshot *&pLastSnapshot = GetClientField<CFrameSnapshot *>(client, s_iLastSnapshotOffset);
+	if (pLastSnapshot == pSnapshot)
+		return false;
+
+	if (nState != BOTPATH_VERIFIED)
+	{
+		check.bCheck = true;
+		return false;
+	}
+
+	// m_pLastSnapshot = pFrame->GetSnapshot(), the new reference is taken before the old one is dropped
+	CFrameSnapshot *pOld = pLastSnapshot;
+	{
+		AUTO_LOCK(m_FrameSnapshotsWriteMutex);
+		s_pAddReference(pSnapshot);
+	}
+	pLastSnapshot = pSnapshot;
+
+	if (pOld)
+		s_pReleaseReference(pOld);
+
+	GetClientField<int>(client, s_iDeltaTickOffset) = s_nSnapshotTick;
+	GetClientField<int>(client, s_iStringTableAckTickOffset) = s_nSnapshotTick;
+
+	// CGameClient::SendSound skips bots, this only matters if a game does not
+	SSF_ClearSounds(client);
+
+	return true;
+}
+
+void SSF_CheckBotSnapshot(IClient *client, const SSFBotSnapshotCheck &check)
+{
+	if (!check.bCheck)
+		return;
+
+	int nExpected = BOTPATH_UNKNOWN;
+
+	if (GetClientField<CFrameSnapshot *>(client, s_iLastSnapshotOffset) != s_pTickSnapshot
+		|| GetClientField<int>(client, s_iDeltaTickOffset) != s_nSnapshotTick
+		|| GetClientField<int>(client, s_iStringTableAckTickOffset) != s_nSnapshotTick)
+	{
+		s_nState.compare_exchange_strong(nExpected, BOTPATH_MISMATCH, std::memory_order_relaxed);
+		return;
+	}
+
+	if (s_nChecks.fetch_add(1, std::memory_order_relaxed) + 1 >= SSF_BOTPATH_CHECKS)
+		s_nState.compare_exchange_strong(nExpected, BOTPATH_VERIFIED, std::memory_order_release);
+}
+
+void SSF_BotPathFrame()
+{
+	if (s_bStateLogged || s_nState.load(std::memory_order_relaxed) != BOTPATH_MISMATCH)
+		return;
+
+	s_bStateLogged = true;
+
+	g_pSM->LogError(myself, "CBaseClient offsets do not match the engine, bot snapshots are encoded.");
+}
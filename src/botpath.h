@@ -0,0 +1,88 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _INCLUDE_SSF_BOTPATH_H_
+#define _INCLUDE_SSF_BOTPATH_H_
+
+/**
+ * @file botpath.h
+ * @brief Snapshots of fake players without a net channel.
+ *
+ * CBaseClient::SendSnapshot (baseclient.cpp) encodes the entities and temp
+ * entities of such clients, then throws the message away, keeps the snapshot
+ * and acks its tick. The fast path only does the bookkeeping. The CBaseClient
+ * offsets are compared with the engine's own sends of the first bots, the
+ * fast path is used once they matched SSF_BOTPATH_CHECKS times in a row.
+ */
+
+#include "extension.h"
+
+class CFrameSnapshot;
+
+#define SSF_BOTPATH_CHECKS		16
+
+/**
+ * @brief State of a bot snapshot sent by the engine, compared with the offsets afterwards.
+ */
+struct SSFBotSnapshotCheck
+{
+	bool			bCheck;		/**< The send is compared */
+};
+
+/**
+ * @brief Loads the CBaseClient offsets and the CFrameSnapshot reference functions.
+ *
+ * @return		True if the fast path can be verified.
+ */
+bool SSF_InitBotPath(IGameConfig *pGameConf);
+
+/**
+ * @brief Sets the tick snapshot the clients are sent this frame. Main thread
+ * only, before the sendsnapshot workers run.
+ *
+ * @param pSnapshot		Tick snapshot of SV_ComputeClientPacks.
+ */
+void SSF_SetBotPathSnapshot(CFrameSnapshot *pSnapshot);
+
+/**
+ * @brief Sends the tick snapshot to a fake player without a net channel
+ * without encoding it: the client keeps a reference to the snapshot, its
+ * delta and string table ack ticks move to the snapshot tick and its sound
+ * queue is emptied.
+ *
+ * @param client		Fake player without a net channel.
+ * @param check			Receives whether the engine send that follows a false return is compared.
+ * @return				True if the snapshot was sent, false if the engine has to send it.
+ */
+bool SSF_SkipBotSnapshot(IClient *client, SSFBotSnapshotCheck &check);
+
+/**
+ * @brief Compares the client fields with the snapshot the engine just sent.
+ *
+ * @param client		Client passed to SSF_SkipBotSnapshot.
+ * @param check			Filled by SSF_SkipBotSnapshot.
+ */
+void SSF_CheckBotSnapshot(IClient *client, const SSFBotSnapshotCheck &check);
+
+/**
+ * @brief Logs a mismatch of the offsets. Called from the game frame hook.
+ */
+void SSF_BotPathFrame();
+
+#endif // _INCLUDE_SSF_BOTPATH_H_
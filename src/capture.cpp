@@ -0,0 +1,238 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "extension.h"
+#include "capture.h"
+#include <atomic>
+#include <string.h>
+#include <stdlib.h>
+#if defined PLATFORM_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define SSF_CAPTURE_DEFAULT_FILE	"ssf_capture.bin"
+#define SSF_CAPTURE_DEFAULT_SIZE	64		// megabytes
+
+extern CGlobalVars *gpGlobals;
+
+volatile bool g_bSSFCapture = false;
+
+static int s_iFile = -1;
+static unsigned char *s_pMapping = NULL;
+static size_t s_nMappingSize = 0;
+static uint32_t s_nCapacity = 0;
+static std::atomic<uint32_t> s_nRecords(0);
+static std::atomic<uint32_t> s_nDropped(0);
+static std::atomic<int> s_nThreads(0);
+static thread_local int s_iThread = -1;
+static double s_flStartTime = 0.0;
+static char s_szPath[PLATFORM_MAX_PATH];
+
+static SSFCaptureHeader *GetHeader()
+{
+	return reinterpret_cast<SSFCaptureHeader *>(s_pMapping);
+}
+
+static SSFCaptureRecord *GetRecords()
+{
+	return reinterpret_cast<SSFCaptureRecord *>(s_pMapping + sizeof(SSFCaptureHeader));
+}
+
+uint32_t SSF_Capture_Time(double flTime)
+{
+	return flTime > s_flStartTime ? (uint32_t)((flTime - s_flStartTime) * 1000000.0) : 0;
+}
+
+SSFCaptureRecord *SSF_Capture_Alloc(SSFCaptureType type)
+{
+	if (!g_bSSFCapture)
+		return NULL;
+
+	uint32_t index = s_nRecords.fetch_add(1, std::memory_order_relaxed);
+	if (index >= s_nCapacity)
+	{
+		s_nDropped.fetch_add(1, std::memory_order_relaxed);
+		return NULL;
+	}
+
+	if (s_iThread < 0)
+		s_iThread = s_nThreads.fetch_add(1, std::memory_order_relaxed);
+
+	SSFCaptureRecord *pRecord = &GetRecords()[index];
+	memset(pRecord, 0, sizeof(*pRecord));
+	pRecord->type = (uint8_t)type;
+	pRecord->thread = (uint8_t)(s_iThread > 255 ? 255 : s_iThread);
+
+	return pRecord;
+}
+
+void SSF_Capture_Frame()
+{
+	if (!g_bSSFCapture)
+		return;
+
+	uint32_t records = s_nRecords.load(std::memory_order_relaxed);
+
+	SSFCaptureHeader *pHeader = GetHeader();
+	pHeader->numRecords = records > s_nCapacity ? s_nCapacity : records;
+	pHeader->droppedRecords = s_nDropped.load(std::memory_order_relaxed);
+}
+
+#if defined PLATFORM_POSIX
+static bool SSF_Capture_Start(const char *path, int megabytes, char *error, size_t maxlength)
+{
+	s_nMappingSize = (size_t)megabytes * 1024 * 1024;
+	s_nCapacity = (uint32_t)((s_nMappingSize - sizeof(SSFCaptureHeader)) / sizeof(SSFCaptureRecord));
+
+	s_iFile = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (s_iFile < 0)
+	{
+		snprintf(error, maxlength, "could not open %s: %s", path, strerror(errno));
+		return false;
+	}
+
+	if (ftruncate(s_iFile, s_nMappingSize) != 0)
+	{
+		snprintf(error, maxlength, "could not grow %s to %d MB: %s", path, megabytes, strerror(errno));
+		close(s_iFile);
+		s_iFile = -1;
+		return false;
+	}
+
+	void *pMapping = mmap(NULL, s_nMappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, s_iFile, 0);
+	if (pMapping == MAP_FAILED)
+	{
+		snprintf(error, maxlength, "could not map %s: %s", path, strerror(errno));
+		close(s_iFile);
+		s_iFile = -1;
+		return false;
+	}
+
+	s_pMapping = static_cast<unsigned char *>(pMapping);
+
+	SSFCaptureHeader *pHeader = GetHeader();
+	memset(pHeader, 0, sizeof(*pHeader));
+	pHeader->magic = SSF_CAPTURE_MAGIC;
+	pHeader->version = SSF_CAPTURE_VERSION;
+	pHeader->recordSize = sizeof(SSFCaptureRecord);
+	pHeader->tickInterval = gpGlobals ? gpGlobals->interval_per_tick : 0.0f;
+
+	s_nRecords.store(0);
+	s_nDropped.store(0);
+	s_flStartTime = Plat_FloatTime();
+	g_bSSFCapture = true;
+
+	return true;
+}
+
+void SSF_Capture_Stop()
+{
+	if (!s_pMapping)
+		return;
+
+	g_bSSFCapture = false;
+	SSF_Capture_Frame();
+
+	uint32_t records = GetHeader()->numRecords;
+
+	munmap(s_pMapping, s_nMappingSize);
+	s_pMapping = NULL;
+
+	// Drop the unused tail of the preallocated file
+	if (ftruncate(s_iFile, sizeof(SSFCaptureHeader) + (size_t)records * sizeof(SSFCaptureRecord)) != 0)
+	{
+		g_pSM->LogError(myself, "Could not truncate capture %s: %s", s_szPath, strerror(errno));
+	}
+
+	close(s_iFile);
+	s_iFile = -1;
+}
+#else
+static bool SSF_Capture_Start(const char *path, int megabytes, char *error, size_t maxlength)
+{
+	snprintf(error, maxlength, "captures are only supported on Linux");
+	return false;
+}
+
+void SSF_Capture_Stop()
+{
+}
+#endif
+
+CON_COMMAND(sm_ssf_capture, "sm_ssf_capture <start [file] [megabytes] | stop | status> - Captures the snapshot workload to a file in sourcemod/data.")
+{
+	const char *cmd = args.ArgC() > 1 ? args.Arg(1) : "status";
+
+	if (!strcmp(cmd, "start"))
+	{
+		if (s_pMapping)
+		{
+			META_CONPRINTF("A capture is already running to %s.\n", s_szPath);
+			return;
+		}
+
+		const char *file = args.ArgC() > 2 ? args.Arg(2) : SSF_CAPTURE_DEFAULT_FILE;
+		int megabytes = args.ArgC() > 3 ? atoi(args.Arg(3)) : SSF_CAPTURE_DEFAULT_SIZE;
+		if (megabytes < 1)
+			megabytes = SSF_CAPTURE_DEFAULT_SIZE;
+
+		// Keep captures inside sourcemod/data
+		if (strstr(file, "..") || strchr(file, '/') || strchr(file, '\\'))
+		{
+			META_CONPRINT("The capture file name cannot contain a path.\n");
+			return;
+		}
+
+		g_pSM->BuildPath(Path_SM, s_szPath, sizeof(s_szPath), "data/%s", file);
+
+		char error[256];
+		if (!SSF_Capture_Start(s_szPath, megabytes, error, sizeof(error)))
+		{
+			META_CONPRINTF("Could not start the capture: %s.\n", error);
+			return;
+		}
+
+		META_CONPRINTF("Capturing to %s, room for %u records.\n", s_szPath, s_nCapacity);
+	}
+	else if (!strcmp(cmd, "stop"))
+	{
+		if (!s_pMapping)
+		{
+			META_CONPRINT("No capture is running.\n");
+			return;
+		}
+
+		uint32_t dropped = s_nDropped.load();
+		SSF_Capture_Stop();
+
+		META_CONPRINTF("Capture saved to %s, %u records dropped.\n", s_szPath, dropped);
+	}
+	else if (s_pMapping)
+	{
+		uint32_t records = s_nRecords.load();
+		META_CONPRINTF("Capturing to %s, %u of %u records used.\n", s_szPath, records > s_nCapacity ? s_nCapacity : records, s_nCapacity);
+	}
+	else
+	{
+		META_CONPRINT("No capture is running.\n");
+	}
+}
@@ -0,0 +1,102 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _INCLUDE_SSF_CAPTURE_H_
+#define _INCLUDE_SSF_CAPTURE_H_
+
+/**
+ * @file capture.h
+ * @brief Workload capture file format and writer.
+ *
+ * A capture is a header followed by fixed-size records, written by the
+ * detours straight into a memory-mapped file. The format has no engine
+ * dependency, tools/ssf_replay.cpp reads it back.
+ */
+
+#include <stdint.h>
+
+#define SSF_CAPTURE_MAGIC		0x50435353	// "SSCP"
+#define SSF_CAPTURE_VERSION		1
+
+enum SSFCaptureType
+{
+	SSFCapture_Frame = 0,				/**< tick = server tick, data[0] = clients sent to this frame */
+	SSFCapture_CreateEmptySnapshot,		/**< tick = snapshot tick, data[0] = max entities */
+	SSFCapture_ReleaseReference,		/**< No data */
+	SSFCapture_WriteTempEntities,		/**< tick = current snapshot tick, data[0] = temp entities in it, data[1] = ev_max */
+	SSFCapture_SendSnapshot,			/**< tick = server tick */
+	SSFCapture_Sounds,					/**< tick = server tick, data[0] = queued sounds, data[1] = written sounds. Needs the FillSoundsMessage detour */
+
+	SSFCapture_NumTypes
+};
+
+struct SSFCaptureHeader
+{
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	recordSize;
+	uint32_t	numRecords;		/**< Valid records following the header */
+	uint32_t	droppedRecords;	/**< Records lost because the file was full */
+	float		tickInterval;
+	uint32_t	reserved[2];
+};
+
+struct SSFCaptureRecord
+{
+	uint8_t		type;			/**< SSFCaptureType */
+	uint8_t		thread;			/**< Small id of the calling thread, 0 = first thread seen */
+	uint16_t	client;			/**< Client index, 0 if none */
+	int32_t		tick;
+	int32_t		data[2];		/**< Type specific, see SSFCaptureType */
+	uint32_t	timeUs;			/**< Call start, microseconds since the capture started */
+	uint32_t	waitUs;			/**< Time spent waiting for the snapshot lock */
+	uint32_t	callUs;			/**< Time spent in the original function */
+	uint32_t	reserved;
+};
+
+#if !defined SSF_STANDALONE
+/**
+ * @brief Capture switch, records must only be written while true.
+ */
+extern volatile bool g_bSSFCapture;
+
+/**
+ * @brief Converts a Plat_FloatTime() timestamp for SSFCaptureRecord::timeUs.
+ */
+uint32_t SSF_Capture_Time(double flTime);
+
+/**
+ * @brief Reserves the next record of the capture. Lock-free.
+ *
+ * @return		Record to fill, NULL if not capturing or the file is full.
+ */
+SSFCaptureRecord *SSF_Capture_Alloc(SSFCaptureType type);
+
+/**
+ * @brief Publishes the header so far. Main thread only.
+ */
+void SSF_Capture_Frame();
+
+/**
+ * @brief Stops and closes a running capture. Main thread only.
+ */
+void SSF_Capture_Stop();
+#endif
+
+#endif // _INCLUDE_SSF_CAPTURE_H_
@@ -0,0 +1,73 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "clientstate.h"
+#include "extension.h"
+#include "convarhelper.h"
+
+SSFClientState g_ClientState[SSF_MAXCLIENTS + 1];
+
+IForward *g_pOnClientSnapshotOverflow = NULL;
+
+volatile bool g_bSSFClientStats = false;
+
+ConVar *g_SvSSFOverflowForwardInterval = CreateConVar("sv_ssf_overflow_forward_interval", "1.0", FCVAR_NOTIFY, "Minimum seconds between two SSF_OnClientSnapshotOverflow calls for the same client.");
+ConVar *g_SvSSFClientStats = CreateConVar("sv_ssf_client_stats", "0", FCVAR_NOTIFY, "Count the lock wait time, snapshot bytes and snapshots of each client for the SSF_GetClient* natives. Overflows are always counted.");
+
+void SSF_ResetClientState(int client)
+{
+	SSFClientState &state = g_ClientState[client];
+
+	state.iMaxTempEntities = -1;
+	state.iMaxSounds = -1;
+	state.nLockWaitUs.store(0, std::memory_order_relaxed);
+	state.nSnapshotBytes.store(0, std::memory_order_relaxed);
+	state.nSnapshots.store(0, std::memory_order_relaxed);
+	state.nOverflows.store(0, std::memory_order_relaxed);
+	state.nPendingOverflows.store(0, std::memory_order_relaxed);
+	state.nBytesSentBase = 0;
+	state.flNextOverflowForward = 0.0;
+	state.sendCost.Reset();
+}
+
+void SSF_ClientStateFrame(double now)
+{
+	g_bSSFClientStats = g_SvSSFClientStats->GetBool();
+
+	if (!g_pOnClientSnapshotOverflow || !g_pOnClientSnapshotOverflow->GetFunctionCount())
+		return;
+
+	for (int client = 1; client <= SSF_MAXCLIENTS; client++)
+	{
+		SSFClientState &state = g_ClientState[client];
+
+		if (now < state.flNextOverflowForward)
+			continue;
+
+		uint32_t overflows = state.nPendingOverflows.exchange(0, std::memory_order_relaxed);
+		if (!overflows)
+			continue;
+
+		state.flNextOverflowForward = now + g_SvSSFOverflowForwardInterval->GetFloat();
+
+		g_pOnClientSnapshotOverflow->PushCell(client);
+		g_pOnClientSnapshotOverflow->PushCell(overflows);
+		g_pOnClientSnapshotOverflow->Execute(NULL);
+	}
+}
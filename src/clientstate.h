@@ -0,0 +1,97 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _INCLUDE_SSF_CLIENTSTATE_H_
+#define _INCLUDE_SSF_CLIENTSTATE_H_
+
+/**
+ * @file clientstate.h
+ * @brief Per-client snapshot budgets and counters.
+ *
+ * Counters are written by whichever sendsnapshot worker handles the client
+ * and read from the main thread by natives and the overflow forward.
+ */
+
+#include <atomic>
+#include <stdint.h>
+
+#include "schedule.h"
+#include <iclient.h>
+#include <iserver.h>
+
+#define SSF_MAXCLIENTS		65	// SM_MAXPLAYERS, indexed by client (slot + 1)
+
+struct SSFClientState
+{
+	int						iMaxTempEntities;	/**< -1 = use sv_multiplayer_maxtempentities */
+	int						iMaxSounds;			/**< -1 = use sv_multiplayer_sounds */
+
+	std::atomic<uint64_t>	nLockWaitUs;		/**< Time spent waiting for the snapshot lock, while g_bSSFClientStats */
+	std::atomic<uint64_t>	nSnapshotBytes;		/**< Sum of the snapshot buffer sizes after temp entities, while g_bSSFClientStats */
+	std::atomic<uint32_t>	nSnapshots;			/**< While g_bSSFClientStats */
+	std::atomic<uint32_t>	nOverflows;
+	std::atomic<uint32_t>	nPendingOverflows;	/**< Not reported to plugins yet */
+	int						nBytesSentBase;		/**< Outgoing net channel total at the last SSF_ResetClientStats, main thread only */
+
+	double					flNextOverflowForward;
+
+	SSFSendCost				sendCost;			/**< SendSnapshot time, drives the send order */
+};
+
+extern SSFClientState g_ClientState[SSF_MAXCLIENTS + 1];
+
+/**
+ * @brief Lock wait, snapshot bytes and snapshot counting switch, refreshed by SSF_ClientStateFrame().
+ */
+extern volatile bool g_bSSFClientStats;
+
+/**
+ * @brief Returns whether a client belongs to the game server. SourceTV and replay
+ * servers keep their own client lists, whose slots overlap the game players'.
+ */
+inline bool SSF_IsGameServerClient(IClient *client)
+{
+	IServer *pServer = client->GetServer();
+	return !pServer->IsHLTV() && !pServer->IsReplay();
+}
+
+/**
+ * @brief Returns the state of a client from its player slot, or NULL if out of range.
+ */
+inline SSFClientState *SSF_GetClientStateBySlot(int slot)
+{
+	int client = slot + 1;
+	if (client < 1 || client > SSF_MAXCLIENTS)
+		return NULL;
+
+	return &g_ClientState[client];
+}
+
+/**
+ * @brief Resets budgets and counters of a client.
+ */
+void SSF_ResetClientState(int client);
+
+/**
+ * @brief Refreshes the stats switch and fires pending overflow forwards,
+ * rate limited per client. Main thread only.
+ */
+void SSF_ClientStateFrame(double now);
+
+#endif // _INCLUDE_SSF_CLIENTSTATE_H_
@@ -32,6 +32,17 @@
 #include "extension.h"
 #include "convarhelper.h"
 #include "CDetour/detours.h"
+#include "ssflog.h"
+#include "clientstate.h"
+#include "ssflock.h"
+#include "abtest.h"
+#include "tempents.h"
+#include "bandwidth.h"
+#include "schedule.h"
+#include "capture.h"
+#include "watchdog.h"
+#include "sounds.h"
+#include "botpath.h"
 #include <sourcehook.h>
 #include <iclient.h>
 #include <iserver.h>
@@ -42,6 +53,8 @@
 
 class CFrameSnapshot;
 class CClientFrame;
+class CGameClient;
+class SVC_Sounds;
 
 class CBaseClient : public IGameEventListener2, public IClient
 {
@@ -58,18 +71,101 @@ CGlobalVars *gpGlobals = NULL;
 CDetour *g_Detour_CBaseServer__WriteTempEntities = NULL;
 CDetour *g_Detour_CFrameSnapshot__ReleaseReference = NULL;
 CDetour *g_Detour_CFrameSnapshot__CreateEmptySnapshot = NULL;
+CDetour *g_Detour_CBaseClient__SendSnapshot = NULL;
+CDetour *g_Detour_SV_ComputeClientPacks = NULL;
+CDetour *g_Detour_CNetworkStringTableContainer__WriteUpdateMessage = NULL;
+CDetour *g_Detour_CGameClient__FillSoundsMessage = NULL;
 
 // Mutex for m_FrameSnapshots array
-CThreadFastMutex									m_FrameSnapshotsWriteMutex;
+SSFLock												m_FrameSnapshotsWriteMutex;
 
-// ConVar *g_SvSSFLog = CreateConVar("sv_ssf_log", "0", FCVAR_NOTIFY, "Log ssf debug print statements.");
+// Detour/lock configuration currently applied, only changed from the game frame hook
+SSFConfig g_ActiveConfig;
+
+// Snapshot phase of the current frame, from SV_ComputeClientPacks to the last SendSnapshot.
+// Only timed while the A/B rotation runs, both are only changed from the main thread.
+volatile bool g_bSSFABActive = false;
+double g_flSnapshotPhaseStart = 0.0;
+double g_flLastGameFrame = 0.0;
+
+// Send phase of the current frame, from the end of SV_ComputeClientPacks to the last SendSnapshot
+std::atomic<int64_t> g_nSendPhaseStart(0);
+std::atomic<int64_t> g_nSendPhaseEnd(0);
+volatile bool g_bSSFSendTiming = false;
+int g_nSendClients = 0;
+int g_iSendHeaviestSlot = -1;
+
+struct SendPhaseStats
+{
+	int		nFrames;
+	int		nMisses;
+	double	flSum;
+	double	flMax;
+};
+
+// Indexed by sv_ssf_send_order
+SendPhaseStats g_SendPhaseStats[2];
+
+ConVar *g_SvSSFLog = CreateConVar("sv_ssf_log", "0", FCVAR_NOTIFY, "Log ssf debug print statements. 1 = notable events, 2 = every detour call.");
+ConVar *g_SvSSFLogLockWait = CreateConVar("sv_ssf_log_lockwait", "1000", FCVAR_NOTIFY, "Snapshot lock waits above this many microseconds are logged as notable events.");
 ConVar *g_sv_multiplayer_maxtempentities = CreateConVar("sv_multiplayer_maxtempentities", "64");
+ConVar *g_SvSSFSendOrder = CreateConVar("sv_ssf_send_order", "1", FCVAR_NOTIFY, "Order of the sendsnapshot work. 0 = player slot order, 1 = most expensive clients first.");
+ConVar *g_SvSSFSendDeadline = CreateConVar("sv_ssf_send_deadline", "0", FCVAR_NOTIFY, "Send phase budget per frame in milliseconds, frames over it are counted and logged. 0 = disabled.");
+ConVar *g_SvSSFSendStats = CreateConVar("sv_ssf_send_stats", "0", FCVAR_NOTIFY, "Time the send phase of every frame for sm_ssf_send_report. Also timed while sv_ssf_send_deadline is set or the A/B rotation runs.");
+ConVar *g_SvSSFTempEntTable = CreateConVar("sv_ssf_tempent_table", "1", FCVAR_NOTIFY, "Flatten the temp entity recipient filters of each tick into per-client bitmasks and skip WriteTempEntities for clients with nothing to receive.");
+ConVar *g_SvSSFSerialNoLock = CreateConVar("sv_ssf_serial_nolock", "1", FCVAR_NOTIFY, "Skip the snapshot lock while sv_parallel_sendsnapshot is 0 and every snapshot call runs on the main thread.");
+ConVar *g_SvSSFStringTableCache = CreateConVar("sv_ssf_stringtable_cache", "1", FCVAR_NOTIFY, "Encode string table updates once per acked tick and share them between clients.");
+ConVar *g_SvSSFBotFastPath = CreateConVar("sv_ssf_bot_fastpath", "1", FCVAR_NOTIFY, "Skip the snapshot encoding of fake players without a net channel (bots, unless sv_stressbots is on).");
+ConVar *g_SvSSFSoundCache = CreateConVar("sv_ssf_sound_cache", "1", FCVAR_NOTIFY, "Delta-encode the sounds queued for every client once per tick and share the bits between clients with the same queue prefix.");
+
+// Engine cvar, NULL if the game has no parallel sendsnapshot switch
+ConVar *g_pSvParallelSendSnapshot = NULL;
+
+// Engine cvars that make clients trace their snapshots, NULL if the game lacks them
+#define NET_TRACE_CVARS	3
+const char *g_NetTraceCvarNames[NET_TRACE_CVARS] = { "sv_netspike", "sv_netspike_sendtime_ms", "sv_netspike_on_reliable_snapshot_overflow" };
+ConVar *g_pNetTraceCvars[NET_TRACE_CVARS] = { NULL, NULL, NULL };
+
+// A traced client gets engine trace output per message, only set from the game frame hook
+volatile bool g_bSSFNetTrace = false;
 
 DETOUR_DECL_MEMBER2(CFrameSnapshot__CreateEmptySnapshot, CFrameSnapshot *, int, tickcount, int, maxEntities )
 {
-	AUTO_LOCK(m_FrameSnapshotsWriteMutex);
-	
-	CFrameSnapshot* snap = DETOUR_MEMBER_CALL(CFrameSnapshot__CreateEmptySnapshot)(tickcount, maxEntities);
+	bool bWatchdog = g_bSSFWatchdog;
+	if (!g_bSSFCapture && !bWatchdog)
+	{
+		AUTO_LOCK(m_FrameSnapshotsWriteMutex);
+		g_nSnapshotsCreated.fetch_add(1, std::memory_order_relaxed);
+
+		return DETOUR_MEMBER_CALL(CFrameSnapshot__CreateEmptySnapshot)(tickcount, maxEntities);
+	}
+
+	double flStart = Plat_FloatTime();
+	CFrameSnapshot* snap;
+	double flLocked, flEnd;
+	{
+		AUTO_LOCK(m_FrameSnapshotsWriteMutex);
+		flLocked = Plat_FloatTime();
+		if (bWatchdog)
+			SSF_Watchdog_Acquire(SSFDetour_CreateEmptySnapshot, 0, flLocked);
+
+		g_nSnapshotsCreated.fetch_add(1, std::memory_order_relaxed);
+		snap = DETOUR_MEMBER_CALL(CFrameSnapshot__CreateEmptySnapshot)(tickcount, maxEntities);
+		flEnd = Plat_FloatTime();
+
+		if (bWatchdog)
+			SSF_Watchdog_Release();
+	}
+
+	SSFCaptureRecord *pRecord = SSF_Capture_Alloc(SSFCapture_CreateEmptySnapshot);
+	if (pRecord)
+	{
+		pRecord->tick = tickcount;
+		pRecord->data[0] = maxEntities;
+		pRecord->timeUs = SSF_Capture_Time(flStart);
+		pRecord->waitUs = (uint32_t)((flLocked - flStart) * 1000000.0);
+		pRecord->callUs = (uint32_t)((flEnd - flLocked) * 1000000.0);
+	}
 
 	return snap;
 }
@@ -81,23 +177,587 @@ DETOUR_DECL_MEMBER2(CFrameSnapshot__CreateEmptySnapshot, CFrameSnapshot *, int,
 
 DETOUR_DECL_MEMBER0(CFrameSnapshot__ReleaseReference, void)
 {
-	AUTO_LOCK(m_FrameSnapshotsWriteMutex);
-	
-	DETOUR_MEMBER_CALL(CFrameSnapshot__ReleaseReference)();
+	bool bWatchdog = g_bSSFWatchdog;
+	if (!g_bSSFCapture && !bWatchdog)
+	{
+		AUTO_LOCK(m_FrameSnapshotsWriteMutex);
+
+		DETOUR_MEMBER_CALL(CFrameSnapshot__ReleaseReference)();
+		return;
+	}
+
+	double flStart = Plat_FloatTime();
+	double flLocked, flEnd;
+	{
+		AUTO_LOCK(m_FrameSnapshotsWriteMutex);
+		flLocked = Plat_FloatTime();
+		if (bWatchdog)
+			SSF_Watchdog_Acquire(SSFDetour_ReleaseReference, 0, flLocked);
+
+		DETOUR_MEMBER_CALL(CFrameSnapshot__ReleaseReference)();
+		flEnd = Plat_FloatTime();
+
+		if (bWatchdog)
+			SSF_Watchdog_Release();
+	}
+
+	SSFCaptureRecord *pRecord = SSF_Capture_Alloc(SSFCapture_ReleaseReference);
+	if (pRecord)
+	{
+		pRecord->timeUs = SSF_Capture_Time(flStart);
+		pRecord->waitUs = (uint32_t)((flLocked - flStart) * 1000000.0);
+		pRecord->callUs = (uint32_t)((flEnd - flLocked) * 1000000.0);
+	}
+}
+
+// Their snapshot is thrown away after encoding. The SourceTV and replay
+// proxies are fake players too but record what they are sent.
+inline bool IsDiscardingClient(IClient *client)
+{
+	return client->IsFakeClient() && !client->GetNetChannel()
+		&& !client->IsHLTV() && !client->IsReplay()
+		&& g_SvSSFBotFastPath->GetBool();
 }
 
 DETOUR_DECL_MEMBER5(CBaseServer__WriteTempEntities, void, CBaseClient *, client, CFrameSnapshot *, pCurrentSnapshot, CFrameSnapshot *, pLastSnapshot, bf_write &, buf, int, ev_max)
 {
+	int iSlot = client->GetPlayerSlot();
+
+	// SourceTV spectator slots overlap the game players', they get neither budgets nor stats
+	bool bGameClient = SSF_IsGameServerClient(client);
+	SSFClientState *pState = bGameClient ? SSF_GetClientStateBySlot(iSlot) : NULL;
+
 	if (!client->IsHLTV() && !client->IsReplay())
 	{
 		// send all unreliable temp entities between last and current frame
 		// send max 64 events in multi player, 255 in SP
-		ev_max = client->GetServer()->IsMultiplayer() ? g_sv_multiplayer_maxtempentities->GetInt() : 255;
+		if (!client->GetServer()->IsMultiplayer())
+			ev_max = 255;
+		else if (pState && pState->iMaxTempEntities >= 0)
+			ev_max = pState->iMaxTempEntities;
+		else
+			ev_max = g_sv_multiplayer_maxtempentities->GetInt();
+	}
+
+	int nStartBits = buf.GetNumBitsWritten();
+	bool bWatchdog = g_bSSFWatchdog;
+	bool bLog = SSFLog_Enabled(SSFLogLevel_Events);
+	bool bStats = pState && g_bSSFClientStats;
+
+	// The clock is only read when something consumes the lock timings
+	bool bTimed = bWatchdog || bLog || bStats || g_bSSFCapture;
+
+	// If no event of the snapshots the engine walks includes the client,
+	// nothing would be written, skip the lock and the call.
+	bool bSkip = false;
+	if (bGameClient && !client->IsHLTV() && !client->IsReplay() && g_TempEntTable.bEnabled)
+	{
+		g_TempEntTableStats.nCalls.fetch_add(1, std::memory_order_relaxed);
+
+		if (!SSF_IsTempEntTableFor(pCurrentSnapshot))
+			g_TempEntTableStats.nUntabled.fetch_add(1, std::memory_order_relaxed);
+		else if (SSF_TempEntTableExcludes(iSlot + 1, pLastSnapshot))
+			bSkip = true;
+
+		if (bSkip)
+			g_TempEntTableStats.nSkipped.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Nothing written for a bot is ever sent
+	if (IsDiscardingClient(client))
+		bSkip = true;
+
+	double flStart = 0.0, flLocked = 0.0, flEnd = 0.0;
+	if (bTimed)
+	{
+		flStart = flLocked = flEnd = Plat_FloatTime();
+	}
+
+	if (!bSkip && !bTimed)
+	{
+		AUTO_LOCK(m_FrameSnapshotsWriteMutex);
+
+		DETOUR_MEMBER_CALL(CBaseServer__WriteTempEntities)(client, pCurrentSnapshot, pLastSnapshot, buf, ev_max);
+	}
+	else if (!bSkip)
+	{
+		AUTO_LOCK(m_FrameSnapshotsWriteMutex);
+		flLocked = Plat_FloatTime();
+		if (bWatchdog)
+			SSF_Watchdog_Acquire(SSFDetour_WriteTempEntities, iSlot + 1, flLocked);
+
+		DETOUR_MEMBER_CALL(CBaseServer__WriteTempEntities)(client, pCurrentSnapshot, pLastSnapshot, buf, ev_max);
+		flEnd = Plat_FloatTime();
+
+		if (bWatchdog)
+			SSF_Watchdog_Release();
+	}
+
+	if (pState && buf.IsOverflowed())
+	{
+		pState->nOverflows.fetch_add(1, std::memory_order_relaxed);
+		pState->nPendingOverflows.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	if (g_bSSFBandwidth && pState)
+	{
+		SSF_BW_RecordTempEnts(iSlot + 1, gpGlobals->tickcount, buf.GetNumBitsWritten() - nStartBits, pCurrentSnapshot, ev_max);
+	}
+
+	if (!bTimed)
+		return;
+
+	int iWaitUs = (int)((flLocked - flStart) * 1000000.0);
+
+	if (bStats)
+	{
+		pState->nLockWaitUs.fetch_add(iWaitUs, std::memory_order_relaxed);
+		pState->nSnapshotBytes.fetch_add(buf.GetNumBytesWritten(), std::memory_order_relaxed);
+		pState->nSnapshots.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	if (g_bSSFCapture)
+	{
+		SSFCaptureRecord *pRecord = SSF_Capture_Alloc(SSFCapture_WriteTempEntities);
+		if (pRecord)
+		{
+			CEventInfo **pEvents;
+
+			pRecord->client = (uint16_t)(iSlot + 1);
+			pRecord->tick = SSF_GetSnapshotTick(pCurrentSnapshot);
+			pRecord->data[0] = SSF_GetSnapshotTempEnts(pCurrentSnapshot, pEvents);
+			pRecord->data[1] = ev_max;
+			pRecord->timeUs = SSF_Capture_Time(flStart);
+			pRecord->waitUs = (uint32_t)iWaitUs;
+			pRecord->callUs = (uint32_t)((flEnd - flLocked) * 1000000.0);
+		}
+	}
+
+	if (!bLog)
+		return;
+
+	if (SSFLog_Enabled(SSFLogLevel_Verbose))
+		SSFLog_Write(SSFLog_TempEntities, iSlot, ev_max, iWaitUs, (int)((flEnd - flLocked) * 1000000.0));
+	else if (iWaitUs >= g_SvSSFLogLockWait->GetInt())
+		SSFLog_Write(SSFLog_LockWait, SSFDetour_WriteTempEntities, iSlot, iWaitUs);
+
+	if (buf.IsOverflowed())
+		SSFLog_Write(SSFLog_Overflow, iSlot, buf.GetNumBitsWritten());
+}
+
+// Measures each client's send cost for the send order and the send phase length
+DETOUR_DECL_MEMBER1(CBaseClient__SendSnapshot, void, CClientFrame *, pFrame)
+{
+	CBaseClient *pClient = reinterpret_cast<CBaseClient *>(this);
+
+	double flStart = Plat_FloatTime();
+
+	// Bots only keep the snapshot and ack its tick, see botpath.h
+	bool bBot = IsDiscardingClient(pClient);
+	SSFBotSnapshotCheck botCheck = { false };
+	if (!bBot || !SSF_SkipBotSnapshot(pClient, botCheck))
+	{
+		DETOUR_MEMBER_CALL(CBaseClient__SendSnapshot)(pFrame);
+
+		if (bBot)
+			SSF_CheckBotSnapshot(pClient, botCheck);
+	}
+
+	double flEnd = Plat_FloatTime();
+
+	// SourceTV slots overlap the player slots and its clients are sent outside the send phase
+	if (!SSF_IsGameServerClient(pClient))
+		return;
+
+	SSFClientState *pState = SSF_GetClientStateBySlot(pClient->GetPlayerSlot());
+	if (pState)
+	{
+		pState->sendCost.AddSample((float)(flEnd - flStart));
+	}
+
+	if (g_bSSFCapture)
+	{
+		SSFCaptureRecord *pRecord = SSF_Capture_Alloc(SSFCapture_SendSnapshot);
+		if (pRecord)
+		{
+			pRecord->client = (uint16_t)(pClient->GetPlayerSlot() + 1);
+			pRecord->tick = gpGlobals->tickcount;
+			pRecord->timeUs = SSF_Capture_Time(flStart);
+			pRecord->callUs = (uint32_t)((flEnd - flStart) * 1000000.0);
+		}
+	}
+
+	if (!g_bSSFSendTiming)
+		return;
+
+	int64_t nEnd = (int64_t)(flEnd * 1000000.0);
+	int64_t nPhaseEnd = g_nSendPhaseEnd.load(std::memory_order_relaxed);
+	while (nEnd > nPhaseEnd && !g_nSendPhaseEnd.compare_exchange_weak(nPhaseEnd, nEnd))
+		;
+}
+
+#define STRINGTABLE_CACHE_ENTRIES	8
+#define STRINGTABLE_CACHE_SIZE		288000	// engine NET_MAX_PAYLOAD
+
+enum
+{
+	STRINGTABLE_CACHE_FREE = 0,
+	STRINGTABLE_CACHE_ENCODING,
+	STRINGTABLE_CACHE_READY,
+};
+
+// String table update of one container for one server tick and acked tick. Entries of
+// older ticks are recycled, every SendSnapshot of the previous tick has returned by then.
+struct StringTableUpdateCache
+{
+	const void			*pContainer;
+	int					nTick;
+	int					nAckTick;
+	std::atomic<int>	nState;
+	int					nBits;
+	bool				bOverflowed;
+	unsigned char		*pData;		// STRINGTABLE_CACHE_SIZE bytes
+};
+
+StringTableUpdateCache g_StringTableCache[STRINGTABLE_CACHE_ENTRIES];
+CThreadFastMutex g_StringTableCacheMutex;
+
+// Returns the entry of this update, or NULL if the cache is full. bEncode is set
+// when the caller claimed the entry and has to fill it.
+StringTableUpdateCache *FindStringTableUpdate(const void *pContainer, int nTick, int nAckTick, bool &bEncode)
+{
+	AUTO_LOCK(g_StringTableCacheMutex);
+
+	bEncode = false;
+
+	for (int i = 0; i < STRINGTABLE_CACHE_ENTRIES; i++)
+	{
+		StringTableUpdateCache &entry = g_StringTableCache[i];
+		if (entry.nState.load(std::memory_order_relaxed) != STRINGTABLE_CACHE_FREE
+			&& entry.pContainer == pContainer && entry.nTick == nTick && entry.nAckTick == nAckTick)
+		{
+			return &entry;
+		}
+	}
+
+	for (int i = 0; i < STRINGTABLE_CACHE_ENTRIES; i++)
+	{
+		StringTableUpdateCache &entry = g_StringTableCache[i];
+		int nState = entry.nState.load(std::memory_order_relaxed);
+		if (nState == STRINGTABLE_CACHE_FREE || (nState == STRINGTABLE_CACHE_READY && entry.nTick != nTick))
+		{
+			if (!entry.pData)
+				entry.pData = new unsigned char[STRINGTABLE_CACHE_SIZE];
+
+			entry.pContainer = pContainer;
+			entry.nTick = nTick;
+			entry.nAckTick = nAckTick;
+			entry.nState.store(STRINGTABLE_CACHE_ENCODING, std::memory_order_relaxed);
+			bEncode = true;
+			return &entry;
+		}
 	}
 
-	AUTO_LOCK(m_FrameSnapshotsWriteMutex);
+	return NULL;
+}
 
-	DETOUR_MEMBER_CALL(CBaseServer__WriteTempEntities)(client, pCurrentSnapshot, pLastSnapshot, buf, ev_max);
+void FreeStringTableCache()
+{
+	for (int i = 0; i < STRINGTABLE_CACHE_ENTRIES; i++)
+	{
+		StringTableUpdateCache &entry = g_StringTableCache[i];
+		delete [] entry.pData;
+		entry.pData = NULL;
+		entry.nState.store(STRINGTABLE_CACHE_FREE, std::memory_order_relaxed);
+	}
+}
+
+// The update only depends on the container, the tick and the acked tick, so clients
+// that acked the same tick share one encoding. Traced clients get per-table trace
+// output from the engine, those are encoded on their own.
+DETOUR_DECL_MEMBER3(CNetworkStringTableContainer__WriteUpdateMessage, void, CBaseClient *, client, int, tick_ack, bf_write &, buf)
+{
+	if (!g_SvSSFStringTableCache->GetBool() || g_bSSFNetTrace)
+	{
+		DETOUR_MEMBER_CALL(CNetworkStringTableContainer__WriteUpdateMessage)(client, tick_ack, buf);
+		return;
+	}
+
+	bool bEncode;
+	StringTableUpdateCache *pEntry = FindStringTableUpdate(this, gpGlobals->tickcount, tick_ack, bEncode);
+
+	if (bEncode)
+	{
+		bf_write cache("CNetworkStringTableContainer::WriteUpdateMessage", pEntry->pData, STRINGTABLE_CACHE_SIZE);
+		DETOUR_MEMBER_CALL(CNetworkStringTableContainer__WriteUpdateMessage)(client, tick_ack, cache);
+
+		pEntry->nBits = cache.GetNumBitsWritten();
+		pEntry->bOverflowed = cache.IsOverflowed();
+		pEntry->nState.store(STRINGTABLE_CACHE_READY, std::memory_order_release);
+	}
+	else if (!pEntry || pEntry->nState.load(std::memory_order_acquire) != STRINGTABLE_CACHE_READY)
+	{
+		// Cache full, or another worker is still encoding this update
+		DETOUR_MEMBER_CALL(CNetworkStringTableContainer__WriteUpdateMessage)(client, tick_ack, buf);
+		return;
+	}
+
+	if (pEntry->bOverflowed)
+	{
+		DETOUR_MEMBER_CALL(CNetworkStringTableContainer__WriteUpdateMessage)(client, tick_ack, buf);
+		return;
+	}
+
+	if (pEntry->nBits > 0)
+	{
+		buf.WriteBits(pEntry->pData, pEntry->nBits);
+	}
+}
+
+DETOUR_DECL_MEMBER1(CGameClient__FillSoundsMessage, int, SVC_Sounds &, msg)
+{
+	CBaseClient *pClient = reinterpret_cast<CBaseClient *>(this);
+
+	// Everything below reads the queue through the gamedata offsets
+	if (!SSF_CheckSoundLayout(pClient, &msg))
+		return DETOUR_MEMBER_CALL(CGameClient__FillSoundsMessage)(msg);
+
+	bool bCapture = g_bSSFCapture;
+	double flStart = bCapture ? Plat_FloatTime() : 0.0;
+	int nQueued = bCapture ? SSF_GetQueuedSounds(pClient) : 0;
+
+	// The engine encoding is kept unless sounds are shared, accounted, or the client has its own budget
+	bool bShare = g_SvSSFSoundCache->GetBool();
+	int nSounds;
+	if (IsDiscardingClient(pClient))
+		nSounds = SSF_DropSounds(pClient, &msg);
+	else if (!bShare && !g_bSSFBandwidth && !SSF_HasSoundBudget(pClient))
+		nSounds = DETOUR_MEMBER_CALL(CGameClient__FillSoundsMessage)(msg);
+	else
+		nSounds = SSF_FillSoundsMessage(pClient, &msg, bShare);
+
+	if (bCapture)
+	{
+		SSFCaptureRecord *pRecord = SSF_Capture_Alloc(SSFCapture_Sounds);
+		if (pRecord)
+		{
+			pRecord->client = (uint16_t)(pClient->GetPlayerSlot() + 1);
+			pRecord->tick = gpGlobals->tickcount;
+			pRecord->data[0] = nQueued;
+			pRecord->data[1] = nSounds;
+			pRecord->timeUs = SSF_Capture_Time(flStart);
+			pRecord->callUs = (uint32_t)((Plat_FloatTime() - flStart) * 1000000.0);
+		}
+	}
+
+	return nSounds;
+}
+
+void UpdateNetTrace()
+{
+	bool bTrace = false;
+	for (int i = 0; i < NET_TRACE_CVARS; i++)
+	{
+		if (g_pNetTraceCvars[i] && g_pNetTraceCvars[i]->GetFloat() != 0.0f)
+			bTrace = true;
+	}
+
+	g_bSSFNetTrace = bTrace;
+}
+
+// Called when SV_ComputeClientPacks returns: SV_SendClientMessages reads sv_parallel_sendsnapshot
+// right after it, nothing holds the lock and no worker runs yet. Plugin SetTransmit callbacks
+// run inside it and may change the cvar, so checking later catches every change.
+void UpdateSerialMode()
+{
+	bool bSerial = g_SvSSFSerialNoLock->GetBool() && g_pSvParallelSendSnapshot && !g_pSvParallelSendSnapshot->GetBool();
+	if (bSerial == m_FrameSnapshotsWriteMutex.IsSerial())
+		return;
+
+	m_FrameSnapshotsWriteMutex.SetSerial(bSerial);
+
+	if (SSFLog_Enabled(SSFLogLevel_Events))
+		g_pSM->LogMessage(myself, "Snapshot lock %s", bSerial ? "disabled, sendsnapshot is serial" : "enabled");
+}
+
+// SV_SendClientMessages hands the same client array to ParallelProcess right after
+// computing the packs, reordering it here decides which clients the workers start with
+DETOUR_DECL_STATIC3(SV_ComputeClientPacks, void, int, clientCount, CGameClient **, clients, CFrameSnapshot *, snapshot)
+{
+	if (g_bSSFABActive)
+		g_flSnapshotPhaseStart = Plat_FloatTime();
+
+	DETOUR_STATIC_CALL(SV_ComputeClientPacks)(clientCount, clients, snapshot);
+
+	UpdateSerialMode();
+
+	// The workers start after this returns, they only read the table
+	SSF_BuildTempEntTable(g_SvSSFTempEntTable->GetBool() ? snapshot : NULL, g_ActiveConfig.bDetours[SSFDetour_CreateEmptySnapshot]);
+	SSF_SetBotPathSnapshot(snapshot);
+
+	float flPriorities[ABSOLUTE_PLAYER_LIMIT];
+	float flHeaviest = -1.0f;
+
+	g_iSendHeaviestSlot = -1;
+
+	if (clientCount > ABSOLUTE_PLAYER_LIMIT)
+		clientCount = ABSOLUTE_PLAYER_LIMIT;
+
+	for (int i = 0; i < clientCount; i++)
+	{
+		int iSlot = reinterpret_cast<CBaseClient *>(clients[i])->GetPlayerSlot();
+		SSFClientState *pState = SSF_GetClientStateBySlot(iSlot);
+
+		flPriorities[i] = pState ? pState->sendCost.GetPriority() : 0.0f;
+		if (flPriorities[i] > flHeaviest)
+		{
+			flHeaviest = flPriorities[i];
+			g_iSendHeaviestSlot = iSlot;
+		}
+	}
+
+	if (g_SvSSFSendOrder->GetInt() == 1 && clientCount > 1)
+	{
+		SSF_SortLongestFirst(clients, flPriorities, clientCount);
+	}
+
+	g_nSendClients = clientCount;
+
+	if (g_bSSFCapture)
+	{
+		SSFCaptureRecord *pRecord = SSF_Capture_Alloc(SSFCapture_Frame);
+		if (pRecord)
+		{
+			pRecord->tick = gpGlobals->tickcount;
+			pRecord->data[0] = clientCount;
+			pRecord->timeUs = SSF_Capture_Time(Plat_FloatTime());
+		}
+	}
+
+	if (g_bSSFSendTiming)
+	{
+		int64_t expected = 0;
+		g_nSendPhaseStart.compare_exchange_strong(expected, (int64_t)(Plat_FloatTime() * 1000000.0));
+	}
+}
+
+void RecordSendPhase(int64_t nPhaseEnd)
+{
+	int64_t nPhaseStart = g_nSendPhaseStart.exchange(0);
+	if (!nPhaseStart || nPhaseEnd <= nPhaseStart)
+		return;
+
+	int iDeadlineUs = (int)(g_SvSSFSendDeadline->GetFloat() * 1000.0f);
+	int iPhaseUs = (int)(nPhaseEnd - nPhaseStart);
+
+	SendPhaseStats &stats = g_SendPhaseStats[g_SvSSFSendOrder->GetInt() == 1 ? 1 : 0];
+	stats.nFrames++;
+	stats.flSum += iPhaseUs / 1000000.0;
+	if (iPhaseUs / 1000000.0 > stats.flMax)
+		stats.flMax = iPhaseUs / 1000000.0;
+
+	if (iDeadlineUs > 0 && iPhaseUs > iDeadlineUs)
+	{
+		stats.nMisses++;
+
+		if (SSFLog_Enabled(SSFLogLevel_Events))
+			SSFLog_Write(SSFLog_DeadlineMiss, iPhaseUs, iDeadlineUs, g_nSendClients, g_iSendHeaviestSlot);
+	}
+}
+
+CON_COMMAND(sm_ssf_send_report, "Prints send phase times and deadline misses per send order.")
+{
+	static const char *s_OrderNames[] = { "slot order", "longest first" };
+
+	if (!g_Detour_CBaseClient__SendSnapshot || !g_Detour_SV_ComputeClientPacks)
+	{
+		META_CONPRINT("The send phase is not timed, the SendSnapshot or SV_ComputeClientPacks detour is unavailable.\n");
+		return;
+	}
+
+	if (!g_bSSFSendTiming)
+	{
+		META_CONPRINT("The send phase is not timed, set sv_ssf_send_stats 1 or sv_ssf_send_deadline.\n");
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		const SendPhaseStats &stats = g_SendPhaseStats[i];
+		if (!stats.nFrames)
+		{
+			META_CONPRINTF("%s: no frames\n", s_OrderNames[i]);
+			continue;
+		}
+
+		META_CONPRINTF("%s: %d frames, mean %.3f ms, max %.3f ms, %d over the deadline\n",
+			s_OrderNames[i], stats.nFrames, stats.flSum / stats.nFrames * 1000.0, stats.flMax * 1000.0, stats.nMisses);
+	}
+}
+
+void ApplyConfig(const SSFConfig &config)
+{
+	CDetour *pDetours[SSFDetour_Count] =
+	{
+		g_Detour_CBaseServer__WriteTempEntities,
+		g_Detour_CFrameSnapshot__ReleaseReference,
+		g_Detour_CFrameSnapshot__CreateEmptySnapshot,
+	};
+
+	for (int i = 0; i < SSFDetour_Count; i++)
+	{
+		if (config.bDetours[i] == g_ActiveConfig.bDetours[i] || !pDetours[i])
+			continue;
+
+		if (config.bDetours[i])
+			pDetours[i]->EnableDetour();
+		else
+			pDetours[i]->DisableDetour();
+	}
+
+	m_FrameSnapshotsWriteMutex.SetMode(config.iLockMode);
+
+	g_ActiveConfig = config;
+}
+
+void OnGameFrame(bool simulating)
+{
+	double flNow = Plat_FloatTime();
+
+	SSFLog_Flush(g_SvSSFLog->GetInt());
+	SSF_ClientStateFrame(flNow);
+	SSF_SoundsFrame();
+	SSF_BotPathFrame();
+	SSF_BW_Frame(gpGlobals->tickcount);
+
+	int64_t nSendPhaseEnd = g_nSendPhaseEnd.exchange(0);
+	RecordSendPhase(nSendPhaseEnd);
+	SSF_Capture_Frame();
+	SSF_Watchdog_Frame();
+	UpdateNetTrace();
+
+	// No sendsnapshot worker runs during the frame hook, the previous frame's
+	// snapshot phase is over. This is the only place detours and lock modes change,
+	// serial mode is switched in SV_ComputeClientPacks.
+	if (g_bSSFABActive && g_flLastGameFrame > 0.0)
+	{
+		// Unknown without the SV_ComputeClientPacks or SendSnapshot detour
+		double flPhaseEnd = nSendPhaseEnd / 1000000.0;
+		double flSnapshotTime = (g_flSnapshotPhaseStart > 0.0 && flPhaseEnd > g_flSnapshotPhaseStart) ? flPhaseEnd - g_flSnapshotPhaseStart : -1.0;
+
+		SSF_RecordFrame(g_ActiveConfig, flNow - g_flLastGameFrame, flSnapshotTime);
+	}
+	g_flSnapshotPhaseStart = 0.0;
+	g_flLastGameFrame = flNow;
+
+	SSFConfig config;
+	g_bSSFABActive = SSF_SelectConfig(flNow, config);
+	if (config != g_ActiveConfig)
+	{
+		ApplyConfig(config);
+	}
+
+	// The send phase CAS is skipped on frames nothing reads it
+	g_bSSFSendTiming = g_bSSFABActive || g_SvSSFSendStats->GetBool() || g_SvSSFSendDeadline->GetFloat() > 0.0f;
 }
 
 bool SSF::SDK_OnMetamodLoad(ISmmAPI *ismm, char *error, size_t maxlen, bool late)
@@ -125,6 +785,11 @@ bool SSF::SDK_OnLoad(char *error, size_t maxlen, bool late)
 
 	CDetourManager::Init(g_pSM->GetScriptingEngine(), g_pGameConf);
 
+	if (!SSF_InitTempEnts(g_pGameConf))
+	{
+		g_pSM->LogError(myself, "CFrameSnapshot offsets are missing, per temp entity class stats and capture snapshot ticks are disabled.");
+	}
+
 	g_Detour_CBaseServer__WriteTempEntities = DETOUR_CREATE_MEMBER(CBaseServer__WriteTempEntities, "CBaseServer__WriteTempEntities");
 	if(!g_Detour_CBaseServer__WriteTempEntities)
 	{
@@ -149,6 +814,95 @@ bool SSF::SDK_OnLoad(char *error, size_t maxlen, bool late)
 	}
 	g_Detour_CFrameSnapshot__CreateEmptySnapshot->EnableDetour();
 
+	g_Detour_CBaseClient__SendSnapshot = DETOUR_CREATE_MEMBER(CBaseClient__SendSnapshot, "CBaseClient__SendSnapshot");
+	if (g_Detour_CBaseClient__SendSnapshot)
+	{
+		g_Detour_CBaseClient__SendSnapshot->EnableDetour();
+	}
+	else
+	{
+		g_pSM->LogError(myself, "Failed to detour CBaseClient__SendSnapshot, send costs and the send phase are not measured.");
+	}
+
+	if (!SSF_InitBotPath(g_pGameConf))
+	{
+		g_pSM->LogError(myself, "CBaseClient offsets or CFrameSnapshot__AddReference are missing, bot snapshots are encoded.");
+	}
+
+	g_Detour_SV_ComputeClientPacks = DETOUR_CREATE_STATIC(SV_ComputeClientPacks, "SV_ComputeClientPacks");
+	if (g_Detour_SV_ComputeClientPacks)
+	{
+		g_Detour_SV_ComputeClientPacks->EnableDetour();
+	}
+	else
+	{
+		g_pSM->LogError(myself, "Failed to detour SV_ComputeClientPacks, the send order, temp entity table, serial lock mode and send phase are disabled.");
+	}
+
+	g_Detour_CNetworkStringTableContainer__WriteUpdateMessage = DETOUR_CREATE_MEMBER(CNetworkStringTableContainer__WriteUpdateMessage, "CNetworkStringTableContainer__WriteUpdateMessage");
+	if (g_Detour_CNetworkStringTableContainer__WriteUpdateMessage)
+	{
+		g_Detour_CNetworkStringTableContainer__WriteUpdateMessage->EnableDetour();
+	}
+	else
+	{
+		g_pSM->LogError(myself, "Failed to detour CNetworkStringTableContainer__WriteUpdateMessage, string table updates are encoded per client.");
+	}
+
+	if (!SSF_InitSounds(g_pGameConf, g_pCVar))
+	{
+		g_pSM->LogError(myself, "CGameClient::m_Sounds or SVC_Sounds offsets are missing, sounds are encoded per client.");
+	}
+	else
+	{
+		g_Detour_CGameClient__FillSoundsMessage = DETOUR_CREATE_MEMBER(CGameClient__FillSoundsMessage, "CGameClient__FillSoundsMessage");
+		if (g_Detour_CGameClient__FillSoundsMessage)
+		{
+			g_Detour_CGameClient__FillSoundsMessage->EnableDetour();
+		}
+		else
+		{
+			g_pSM->LogError(myself, "Failed to detour CGameClient__FillSoundsMessage, sounds are encoded per client.");
+		}
+	}
+
+	// SSF_SetClientMaxSounds and the sound bandwidth accounting need the detour
+	g_bSSFSoundDetour = g_Detour_CGameClient__FillSoundsMessage != NULL;
+
+	for (int i = 0; i < SSFDetour_Count; i++)
+	{
+		g_ActiveConfig.bDetours[i] = true;
+	}
+	g_ActiveConfig.iLockMode = SSFLockMode_Spin;
+	m_FrameSnapshotsWriteMutex.SetMode(SSFLockMode_Spin);
+	m_FrameSnapshotsWriteMutex.SetSerial(false);
+
+	// Unknown threading model without the cvar, keep locking
+	g_pSvParallelSendSnapshot = g_pCVar->FindVar("sv_parallel_sendsnapshot");
+	if (!g_pSvParallelSendSnapshot)
+	{
+		g_pSM->LogError(myself, "sv_parallel_sendsnapshot not found, the snapshot lock stays on in serial mode.");
+	}
+
+	for (int i = 0; i < NET_TRACE_CVARS; i++)
+	{
+		g_pNetTraceCvars[i] = g_pCVar->FindVar(g_NetTraceCvarNames[i]);
+	}
+	UpdateNetTrace();
+	g_flLastGameFrame = 0.0;
+	SSF_ResetABTest();
+
+	for (int client = 1; client <= SSF_MAXCLIENTS; client++)
+	{
+		SSF_ResetClientState(client);
+		SSF_BW_ResetClient(client);
+	}
+
+	g_pOnClientSnapshotOverflow = forwards->CreateForward("SSF_OnClientSnapshotOverflow", ET_Ignore, 2, NULL, Param_Cell, Param_Cell);
+	playerhelpers->AddClientListener(this);
+
+	g_pSM->AddGameFrameHook(&OnGameFrame);
+
 	AutoExecConfig(g_pCVar, true);
 
 	return true;
@@ -156,6 +910,15 @@ bool SSF::SDK_OnLoad(char *error, size_t maxlen, bool late)
 
 void SSF::SDK_OnUnload()
 {
+	g_pSM->RemoveGameFrameHook(&OnGameFrame);
+	playerhelpers->RemoveClientListener(this);
+
+	if (g_pOnClientSnapshotOverflow)
+	{
+		forwards->ReleaseForward(g_pOnClientSnapshotOverflow);
+		g_pOnClientSnapshotOverflow = NULL;
+	}
+
 	if(g_Detour_CBaseServer__WriteTempEntities)
 	{
 		g_Detour_CBaseServer__WriteTempEntities->Destroy();
@@ -174,11 +937,55 @@ void SSF::SDK_OnUnload()
 		g_Detour_CFrameSnapshot__CreateEmptySnapshot = NULL;
 	}
 
+	if (g_Detour_CBaseClient__SendSnapshot)
+	{
+		g_Detour_CBaseClient__SendSnapshot->Destroy();
+		g_Detour_CBaseClient__SendSnapshot = NULL;
+	}
+
+	if (g_Detour_SV_ComputeClientPacks)
+	{
+		g_Detour_SV_ComputeClientPacks->Destroy();
+		g_Detour_SV_ComputeClientPacks = NULL;
+	}
+
+	if (g_Detour_CNetworkStringTableContainer__WriteUpdateMessage)
+	{
+		g_Detour_CNetworkStringTableContainer__WriteUpdateMessage->Destroy();
+		g_Detour_CNetworkStringTableContainer__WriteUpdateMessage = NULL;
+	}
+
+	if (g_Detour_CGameClient__FillSoundsMessage)
+	{
+		g_Detour_CGameClient__FillSoundsMessage->Destroy();
+		g_Detour_CGameClient__FillSoundsMessage = NULL;
+	}
+	g_bSSFSoundDetour = false;
+
+	FreeStringTableCache();
+
+	SSF_Capture_Stop();
+	SSF_Watchdog_Stop();
+
+	SSFLog_Flush(SSFLogLevel_Off);
+	SSFLog_Shutdown();
+
 	gameconfs->CloseGameConfigFile(g_pGameConf);
 }
 
 void SSF::SDK_OnAllLoaded()
 {
+	sharesys->AddNatives(myself, g_SSFNatives);
+	sharesys->RegisterLibrary(myself, "sendsnapshotfixer");
+}
+
+void SSF::OnClientDisconnected(int client)
+{
+	if (client >= 1 && client <= SSF_MAXCLIENTS)
+	{
+		SSF_ResetClientState(client);
+		SSF_BW_ResetClient(client);
+	}
 }
 
 bool SSF::RegisterConCommandBase(ConCommandBase *pVar)
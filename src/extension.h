@@ -39,13 +39,26 @@
 
 #include "smsdk_ext.h"
 
+/**
+ * @brief Detours installed by the extension, used to tag diagnostics.
+ */
+enum SSFDetour
+{
+	SSFDetour_WriteTempEntities = 0,
+	SSFDetour_ReleaseReference,
+	SSFDetour_CreateEmptySnapshot,
+
+	SSFDetour_Count
+};
+
 /**
  * @brief Sample implementation of the SDK Extension.
  * Note: Uncomment one of the pre-defined virtual functions in order to use it.
  */
 class SSF :
 	public SDKExtension,
-	public IConCommandBaseAccessor
+	public IConCommandBaseAccessor,
+	public IClientListener
 {
 public:
 	/**
@@ -118,6 +131,12 @@ public:
 
 public:  // IConCommandBaseAccessor
 	virtual bool RegisterConCommandBase(ConCommandBase *pVar);
+
+public:  // IClientListener
+	virtual void OnClientDisconnected(int client);
 };
 
+extern const sp_nativeinfo_t g_SSFNatives[];
+extern IForward *g_pOnClientSnapshotOverflow;
+
 #endif // _INCLUDE_SOURCEMOD_EXTENSION_PROPER_H_
@@ -0,0 +1,165 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "extension.h"
+#include "clientstate.h"
+#include "sounds.h"
+#include <inetchannelinfo.h>
+
+static SSFClientState *GetClientState(IPluginContext *pContext, cell_t client)
+{
+	if (client < 1 || client > SSF_MAXCLIENTS)
+	{
+		pContext->ThrowNativeError("Client index %d is invalid", client);
+		return NULL;
+	}
+
+	IGamePlayer *pPlayer = playerhelpers->GetGamePlayer(client);
+	if (!pPlayer || !pPlayer->IsConnected())
+	{
+		pContext->ThrowNativeError("Client %d is not connected", client);
+		return NULL;
+	}
+
+	return &g_ClientState[client];
+}
+
+static cell_t SSF_GetClientMaxTempEntities(IPluginContext *pContext, const cell_t *params)
+{
+	SSFClientState *pState = GetClientState(pContext, params[1]);
+	if (!pState)
+		return 0;
+
+	return pState->iMaxTempEntities;
+}
+
+static cell_t SSF_SetClientMaxTempEntities(IPluginContext *pContext, const cell_t *params)
+{
+	SSFClientState *pState = GetClientState(pContext, params[1]);
+	if (!pState)
+		return 0;
+
+	// The engine writes the temp entity count on 8 bits
+	pState->iMaxTempEntities = params[2] < 0 ? -1 : (params[2] > 255 ? 255 : params[2]);
+	return 1;
+}
+
+static cell_t SSF_GetClientMaxSounds(IPluginContext *pContext, const cell_t *params)
+{
+	SSFClientState *pState = GetClientState(pContext, params[1]);
+	if (!pState)
+		return 0;
+
+	return pState->iMaxSounds;
+}
+
+static cell_t SSF_SetClientMaxSounds(IPluginContext *pContext, const cell_t *params)
+{
+	SSFClientState *pState = GetClientState(pContext, params[1]);
+	if (!pState)
+		return 0;
+
+	// The sound count is written on 8 bits as well
+	pState->iMaxSounds = params[2] < 0 ? -1 : (params[2] > 255 ? 255 : params[2]);
+	return g_bSSFSoundDetour ? 1 : 0;
+}
+
+static cell_t SSF_GetClientLockWaitTime(IPluginContext *pContext, const cell_t *params)
+{
+	SSFClientState *pState = GetClientState(pContext, params[1]);
+	if (!pState)
+		return 0;
+
+	float flSeconds = (float)(pState->nLockWaitUs.load(std::memory_order_relaxed) / 1000000.0);
+	return sp_ftoc(flSeconds);
+}
+
+// Bots have no net channel and never send anything
+static int GetClientTotalBytesSent(int client)
+{
+	INetChannelInfo *pNetChannel = engine->GetPlayerNetInfo(client);
+	return pNetChannel ? pNetChannel->GetTotalData(FLOW_OUTGOING) : 0;
+}
+
+static cell_t SSF_GetClientBytesSent(IPluginContext *pContext, const cell_t *params)
+{
+	SSFClientState *pState = GetClientState(pContext, params[1]);
+	if (!pState)
+		return 0;
+
+	int nBytes = GetClientTotalBytesSent(params[1]) - pState->nBytesSentBase;
+	return nBytes > 0 ? nBytes : 0;
+}
+
+static cell_t SSF_GetClientSnapshotBytes(IPluginContext *pContext, const cell_t *params)
+{
+	SSFClientState *pState = GetClientState(pContext, params[1]);
+	if (!pState)
+		return 0;
+
+	uint64_t nBytes = pState->nSnapshotBytes.load(std::memory_order_relaxed);
+	return nBytes > 0x7FFFFFFF ? 0x7FFFFFFF : (cell_t)nBytes;
+}
+
+static cell_t SSF_GetClientSnapshotCount(IPluginContext *pContext, const cell_t *params)
+{
+	SSFClientState *pState = GetClientState(pContext, params[1]);
+	if (!pState)
+		return 0;
+
+	return pState->nSnapshots.load(std::memory_order_relaxed);
+}
+
+static cell_t SSF_GetClientOverflowCount(IPluginContext *pContext, const cell_t *params)
+{
+	SSFClientState *pState = GetClientState(pContext, params[1]);
+	if (!pState)
+		return 0;
+
+	return pState->nOverflows.load(std::memory_order_relaxed);
+}
+
+static cell_t SSF_ResetClientStats(IPluginContext *pContext, const cell_t *params)
+{
+	SSFClientState *pState = GetClientState(pContext, params[1]);
+	if (!pState)
+		return 0;
+
+	pState->nLockWaitUs.store(0, std::memory_order_relaxed);
+	pState->nSnapshotBytes.store(0, std::memory_order_relaxed);
+	pState->nSnapshots.store(0, std::memory_order_relaxed);
+	pState->nOverflows.store(0, std::memory_order_relaxed);
+	pState->nBytesSentBase = GetClientTotalBytesSent(params[1]);
+	return 1;
+}
+
+const sp_nativeinfo_t g_SSFNatives[] =
+{
+	{"SSF_GetClientMaxTempEntities",	SSF_GetClientMaxTempEntities},
+	{"SSF_SetClientMaxTempEntities",	SSF_SetClientMaxTempEntities},
+	{"SSF_GetClientMaxSounds",			SSF_GetClientMaxSounds},
+	{"SSF_SetClientMaxSounds",			SSF_SetClientMaxSounds},
+	{"SSF_GetClientLockWaitTime",		SSF_GetClientLockWaitTime},
+	{"SSF_GetClientBytesSent",			SSF_GetClientBytesSent},
+	{"SSF_GetClientSnapshotBytes",		SSF_GetClientSnapshotBytes},
+	{"SSF_GetClientSnapshotCount",		SSF_GetClientSnapshotCount},
+	{"SSF_GetClientOverflowCount",		SSF_GetClientOverflowCount},
+	{"SSF_ResetClientStats",			SSF_ResetClientStats},
+	{NULL,								NULL},
+};
@@ -0,0 +1,98 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _INCLUDE_SSF_SCHEDULE_H_
+#define _INCLUDE_SSF_SCHEDULE_H_
+
+/**
+ * @file schedule.h
+ * @brief Longest-job-first ordering of the sendsnapshot work.
+ *
+ * The engine hands the client array built in SV_SendClientMessages to
+ * ParallelProcess, whose workers pull the next item from a shared index.
+ * Putting the most expensive clients first is enough for idle workers to
+ * pick up the cheap tail, so the frame no longer waits on a heavy client
+ * that happened to start last.
+ *
+ * Has no engine dependency so the offline replayer can use it as well.
+ */
+
+#define SSF_SEND_COST_ALPHA		0.25f	// weight of the newest sample in the moving average
+
+/**
+ * @brief Send cost history of a client.
+ */
+struct SSFSendCost
+{
+	float	flAverage;	/**< Exponential moving average, seconds */
+	float	flLast;		/**< Last sample, seconds */
+
+	void Reset()
+	{
+		flAverage = 0.0f;
+		flLast = 0.0f;
+	}
+
+	void AddSample(float flCost)
+	{
+		flAverage = flAverage > 0.0f ? flAverage + (flCost - flAverage) * SSF_SEND_COST_ALPHA : flCost;
+		flLast = flCost;
+	}
+
+	/**
+	 * @brief Expected cost of the next send. A spike such as a full update
+	 * is trusted right away, the average only decays it.
+	 */
+	float GetPriority() const
+	{
+		return flLast > flAverage ? flLast : flAverage;
+	}
+};
+
+/**
+ * @brief Sorts items by descending priority. Stable, so clients with the
+ * same priority (e.g. no history yet) keep the engine's slot order.
+ *
+ * @param items			Work items, reordered in place.
+ * @param priorities	Priority of each item, reordered along.
+ * @param count			Number of items.
+ */
+template <typename T>
+inline void SSF_SortLongestFirst(T *items, float *priorities, int count)
+{
+	// Insertion sort, count is at most the player limit
+	for (int i = 1; i < count; i++)
+	{
+		T item = items[i];
+		float priority = priorities[i];
+
+		int j = i - 1;
+		while (j >= 0 && priorities[j] < priority)
+		{
+			items[j + 1] = items[j];
+			priorities[j + 1] = priorities[j];
+			j--;
+		}
+
+		items[j + 1] = item;
+		priorities[j + 1] = priority;
+	}
+}
+
+#endif // _INCLUDE_SSF_SCHEDULE_H_
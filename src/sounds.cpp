@@ -0,0 +1,368 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "sounds.h"
+#include "clientstate.h"
+#include "bandwidth.h"
+#include <atomic>
+#include <iclient.h>
+#include <iserver.h>
+#include <soundinfo.h>
+#include <threadtools.h>
+#include <utlvector.h>
+
+extern CGlobalVars *gpGlobals;
+
+#define SOUND_CACHE_BUFFER_SIZE		16384
+#define SOUND_CACHE_MAX_SOUNDS		255		// the sound count is written on 8 bits
+
+bool g_bSSFSoundDetour = false;
+
+static int s_iSoundsOffset = -1;			// CGameClient::m_Sounds
+static int s_iReliableSoundOffset = -1;		// SVC_Sounds::m_bReliableSound
+static int s_iNumSoundsOffset = -1;			// SVC_Sounds::m_nNumSounds
+static int s_iDataOutOffset = -1;			// SVC_Sounds::m_DataOut
+
+// Engine cvars, NULL if the game lacks them
+static ConVar *s_pMultiplayerSounds = NULL;
+static ConVar *s_pDiscardExtraUnreliable = NULL;
+
+enum
+{
+	SOUND_LAYOUT_UNKNOWN = 0,
+	SOUND_LAYOUT_VERIFIED,
+	SOUND_LAYOUT_MISMATCH,
+};
+
+// The gamedata offsets are checked against every message the engine hands the detour
+static std::atomic<int> s_nLayout(SOUND_LAYOUT_UNKNOWN);
+static bool s_bLayoutLogged = false;
+
+// tier1/utlvector.h, CUtlMemory followed by the size and the debugger element pointer
+struct SoundVectorLayout
+{
+	void	*pMemory;
+	int		nAllocationCount;
+	int		nGrowSize;
+	int		nSize;
+	void	*pElements;
+};
+
+enum
+{
+	SOUND_CACHE_FREE = 0,
+	SOUND_CACHE_ENCODING,
+	SOUND_CACHE_READY,
+};
+
+// Queue of the first client written this tick, delta-encoded from the default sound
+struct SoundEncodeCache
+{
+	int					nTick;
+	std::atomic<int>	nState;
+	int					nSounds;
+	SoundInfo_t			sounds[SOUND_CACHE_MAX_SOUNDS];
+	int					nEndBits[SOUND_CACHE_MAX_SOUNDS];	// bits written after each sound
+	unsigned char		data[SOUND_CACHE_BUFFER_SIZE];
+};
+
+static SoundEncodeCache s_SoundCache;
+static CThreadFastMutex s_SoundCacheMutex;
+
+bool SSF_InitSounds(IGameConfig *pGameConf, ICvar *pCvar)
+{
+	s_pMultiplayerSounds = pCvar->FindVar("sv_multiplayer_sounds");
+	s_pDiscardExtraUnreliable = pCvar->FindVar("sv_sound_discardextraunreliable");
+
+	if (!pGameConf->GetOffset("CGameClient::m_Sounds", &s_iSoundsOffset)
+		|| !pGameConf->GetOffset("SVC_Sounds::m_bReliableSound", &s_iReliableSoundOffset)
+		|| !pGameConf->GetOffset("SVC_Sounds::m_nNumSounds", &s_iNumSoundsOffset)
+		|| !pGameConf->GetOffset("SVC_Sounds::m_DataOut", &s_iDataOutOffset))
+	{
+		s_iSoundsOffset = -1;
+		return false;
+	}
+
+	return true;
+}
+
+static inline CUtlVector<SoundInfo_t> &GetSounds(IClient *client)
+{
+	return *reinterpret_cast<CUtlVector<SoundInfo_t> *>(reinterpret_cast<unsigned char *>(client) + s_iSoundsOffset);
+}
+
+template <typename T>
+static inline T &GetMessageField(void *msg, int offset)
+{
+	return *reinterpret_cast<T *>(reinterpret_cast<unsigned char *>(msg) + offset);
+}
+
+// Every field that SoundInfo_t::WriteDelta may encode, and then some
+static bool SoundInfo_Equal(const SoundInfo_t &a, const SoundInfo_t &b)
+{
+	return a.nSequenceNumber == b.nSequenceNumber
+		&& a.nEntityIndex == b.nEntityIndex
+		&& a.nChannel == b.nChannel
+		&& a.nSoundNum == b.nSoundNum
+		&& a.nFlags == b.nFlags
+		&& a.vOrigin == b.vOrigin
+		&& a.vDirection == b.vDirection
+		&& a.vListenerOrigin == b.vListenerOrigin
+		&& a.fVolume == b.fVolume
+		&& a.Soundlevel == b.Soundlevel
+		&& a.bLooping == b.bLooping
+		&& a.nPitch == b.nPitch
+		&& a.nSpecialDSP == b.nSpecialDSP
+		&& a.fDelay == b.fDelay
+		&& a.bIsSentence == b.bIsSentence
+		&& a.bIsAmbient == b.bIsAmbient
+		&& a.nSpeakerEntity == b.nSpeakerEntity;
+}
+
+// Writes the longest cached prefix of the first count sounds and returns its length
+static int WriteCachedSounds(CUtlVector<SoundInfo_t> &sounds, int count, bf_write &buf)
+{
+	int nTick = gpGlobals->tickcount;
+	bool bEncode = false;
+	{
+		AUTO_LOCK(s_SoundCacheMutex);
+
+		// Acquire pairs with the release of the encoding worker, which publishes outside the mutex
+		int nState = s_SoundCache.nState.load(std::memory_order_acquire);
+		if (nState == SOUND_CACHE_FREE || (nState == SOUND_CACHE_READY && s_SoundCache.nTick != nTick))
+		{
+			// Every SendSnapshot of the previous tick has returned, the entry can be recycled
+			s_SoundCache.nTick = nTick;
+			s_SoundCache.nState.store(SOUND_CACHE_ENCODING, std::memory_order_relaxed);
+			bEncode = true;
+		}
+		else if (nState != SOUND_CACHE_READY)
+		{
+			// Another worker is still encoding
+			return 0;
+		}
+	}
+
+	if (bEncode)
+	{
+		bf_write cache("CGameClient::FillSoundsMessage", s_SoundCache.data, sizeof(s_SoundCache.data));
+
+		SoundInfo_t defaultSound;
+		SoundInfo_t *pDeltaSound = &defaultSound;
+
+		int i;
+		for (i = 0; i < count; i++)
+		{
+			SoundInfo_t &sound = sounds[i];
+			sound.WriteDelta(pDeltaSound, cache);
+			if (cache.IsOverflowed())
+				break;
+
+			s_SoundCache.sounds[i] = sound;
+			s_SoundCache.nEndBits[i] = cache.GetNumBitsWritten();
+			pDeltaSound = &sound;
+		}
+
+		s_SoundCache.nSounds = i;
+		s_SoundCache.nState.store(SOUND_CACHE_READY, std::memory_order_release);
+	}
+
+	int nCached = 0;
+	int nMaxCached = count < s_SoundCache.nSounds ? count : s_SoundCache.nSounds;
+	while (nCached < nMaxCached && SoundInfo_Equal(sounds[nCached], s_SoundCache.sounds[nCached]))
+	{
+		nCached++;
+	}
+
+	if (nCached > 0)
+	{
+		buf.WriteBits(s_SoundCache.data, s_SoundCache.nEndBits[nCached - 1]);
+
+		if (g_bSSFBandwidth)
+		{
+			for (int i = 0; i < nCached; i++)
+			{
+				SSF_BW_RecordSound(s_SoundCache.sounds[i].nSoundNum, s_SoundCache.nEndBits[i] - (i ? s_SoundCache.nEndBits[i - 1] : 0));
+			}
+		}
+	}
+
+	return nCached;
+}
+
+bool SSF_CheckSoundLayout(IClient *client, void *msg)
+{
+	int nLayout = s_nLayout.load(std::memory_order_relaxed);
+	if (nLayout == SOUND_LAYOUT_MISMATCH)
+		return false;
+
+	// The engine only fills a message when sounds are queued, into an empty NET_MAX_PAYLOAD buffer
+	const SoundVectorLayout &sounds = *reinterpret_cast<const SoundVectorLayout *>(reinterpret_cast<unsigned char *>(client) + s_iSoundsOffset);
+	bf_write &out = GetMessageField<bf_write>(msg, s_iDataOutOffset);
+
+	bool bValid = sounds.pMemory && sounds.pMemory == sounds.pElements
+		&& sounds.nSize > 0 && sounds.nSize <= sounds.nAllocationCount && sounds.nAllocationCount <= 65536
+		&& out.GetBasePointer() && out.GetMaxNumBits() > 0 && !out.GetNumBitsWritten() && !out.IsOverflowed();
+
+	if (!bValid)
+	{
+		s_nLayout.store(SOUND_LAYOUT_MISMATCH, std::memory_order_relaxed);
+		return false;
+	}
+
+	if (nLayout == SOUND_LAYOUT_UNKNOWN)
+		s_nLayout.store(SOUND_LAYOUT_VERIFIED, std::memory_order_relaxed);
+
+	return true;
+}
+
+bool SSF_IsSoundLayoutVerified()
+{
+	return s_nLayout.load(std::memory_order_relaxed) == SOUND_LAYOUT_VERIFIED;
+}
+
+void SSF_SoundsFrame()
+{
+	if (s_bLayoutLogged || s_nLayout.load(std::memory_order_relaxed) != SOUND_LAYOUT_MISMATCH)
+		return;
+
+	s_bLayoutLogged = true;
+	g_bSSFSoundDetour = false;
+
+	g_pSM->LogError(myself, "CGameClient::m_Sounds or SVC_Sounds offsets do not match the engine, sounds are encoded per client.");
+}
+
+static SSFClientState *GetGameClientState(IClient *client)
+{
+	return SSF_IsGameServerClient(client) ? SSF_GetClientStateBySlot(client->GetPlayerSlot()) : NULL;
+}
+
+bool SSF_HasSoundBudget(IClient *client)
+{
+	SSFClientState *pState = GetGameClientState(client);
+	return pState && pState->iMaxSounds >= 0;
+}
+
+int SSF_GetMaxSounds(IClient *client)
+{
+	if (!client->GetServer()->IsMultiplayer())
+		return SOUND_CACHE_MAX_SOUNDS;
+
+	SSFClientState *pState = GetGameClientState(client);
+	if (pState && pState->iMaxSounds >= 0)
+		return pState->iMaxSounds;
+
+	return s_pMultiplayerSounds ? s_pMultiplayerSounds->GetInt() : 20;
+}
+
+int SSF_GetQueuedSounds(IClient *client)
+{
+	return GetSounds(client).Count();
+}
+
+int SSF_DropSounds(IClient *client, void *msg)
+{
+	GetSounds(client).RemoveAll();
+
+	GetMessageField<int>(msg, s_iNumSoundsOffset) = 0;
+	GetMessageField<bool>(msg, s_iReliableSoundOffset) = false;
+
+	return 0;
+}
+
+void SSF_ClearSounds(IClient *client)
+{
+	if (!SSF_IsSoundLayoutVerified())
+		return;
+
+	CUtlVector<SoundInfo_t> &sounds = GetSounds(client);
+	if (sounds.Count())
+		sounds.RemoveAll();
+}
+
+int SSF_FillSoundsMessage(IClient *client, void *msg, bool bShare)
+{
+	CUtlVector<SoundInfo_t> &sounds = GetSounds(client);
+	bf_write &out = GetMessageField<bf_write>(msg, s_iDataOutOffset);
+
+	int nMaxSounds = SSF_GetMaxSounds(client);
+	int i, count = sounds.Count();
+
+	// Discard events if we have too many to signal with 8 bits
+	if (count > nMaxSounds)
+		count = nMaxSounds;
+
+	// Nothing to send
+	if (!count)
+		return 0;
+
+	GetMessageField<int>(msg, s_iNumSoundsOffset) = count;
+	GetMessageField<bool>(msg, s_iReliableSoundOffset) = false;
+
+	int nStartBits = out.GetNumBitsWritten();
+
+	// Broadcast sounds are encoded once per tick and shared between clients
+	int nCached = bShare ? WriteCachedSounds(sounds, count, out) : 0;
+
+	SoundInfo_t defaultSound;
+	SoundInfo_t *pDeltaSound = nCached > 0 ? &sounds[nCached - 1] : &defaultSound;
+
+	for (i = nCached; i < count; i++)
+	{
+		SoundInfo_t &sound = sounds[i];
+		int nSoundStartBits = out.GetNumBitsWritten();
+		sound.WriteDelta(pDeltaSound, out);
+		pDeltaSound = &sound;
+
+		if (g_bSSFBandwidth)
+		{
+			SSF_BW_RecordSound(sound.nSoundNum, out.GetNumBitsWritten() - nSoundStartBits);
+		}
+	}
+
+	if (g_bSSFBandwidth && SSF_IsGameServerClient(client))
+	{
+		SSF_BW_RecordSounds(client->GetPlayerSlot() + 1, gpGlobals->tickcount, out.GetNumBitsWritten() - nStartBits);
+	}
+
+	// Remove added events from list
+	if (s_pDiscardExtraUnreliable && s_pDiscardExtraUnreliable->GetBool())
+	{
+		if (sounds.Count() != count)
+		{
+			DevMsg(2, "Warning! Dropped %i unreliable sounds for client %s.\n", sounds.Count() - count, client->GetClientName());
+		}
+		sounds.RemoveAll();
+	}
+	else
+	{
+		int remove = sounds.Count() - (count + nMaxSounds);
+		if (remove > 0)
+		{
+			DevMsg(2, "Warning! Dropped %i unreliable sounds for client %s.\n", remove, client->GetClientName());
+			count += remove;
+		}
+
+		if (count > 0)
+		{
+			sounds.RemoveMultiple(0, count);
+		}
+	}
+
+	return GetMessageField<int>(msg, s_iNumSoundsOffset);
+}
@@ -0,0 +1,117 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _INCLUDE_SSF_SOUNDS_H_
+#define _INCLUDE_SSF_SOUNDS_H_
+
+/**
+ * @file sounds.h
+ * @brief CGameClient::FillSoundsMessage with a delta encoding shared between clients.
+ *
+ * Broadcast sounds sit at the same position in every client's queue. The
+ * first client written in a tick encodes its queue into a shared buffer,
+ * the others copy the bits of the prefix they have in common and only
+ * encode the rest themselves. Needs the CGameClient::m_Sounds and
+ * SVC_Sounds offsets from the gamedata.
+ */
+
+#include "extension.h"
+
+class IClient;
+class ICvar;
+
+/**
+ * @brief Whether the FillSoundsMessage detour is installed. Per-client sound
+ * budgets and the sound bandwidth accounting need it.
+ */
+extern bool g_bSSFSoundDetour;
+
+/**
+ * @brief Loads the sound queue and message offsets and looks up the engine sound cvars.
+ *
+ * @return		True if SSF_FillSoundsMessage can be used.
+ */
+bool SSF_InitSounds(IGameConfig *pGameConf, ICvar *pCvar);
+
+/**
+ * @brief Checks the gamedata offsets against a message the engine is about to fill.
+ * The first mismatch turns the sound replacement off for good. SSF_InitSounds must have succeeded.
+ *
+ * @param client		CGameClient.
+ * @param msg			SVC_Sounds message passed to FillSoundsMessage.
+ * @return				True if the other sound functions may be used for this call.
+ */
+bool SSF_CheckSoundLayout(IClient *client, void *msg);
+
+/**
+ * @brief Returns whether the offsets matched at least one message and never mismatched.
+ */
+bool SSF_IsSoundLayoutVerified();
+
+/**
+ * @brief Logs a mismatch found by SSF_CheckSoundLayout and clears g_bSSFSoundDetour. Main thread only.
+ */
+void SSF_SoundsFrame();
+
+/**
+ * @brief Returns whether a game server client has a sound budget set through SSF_SetClientMaxSounds.
+ */
+bool SSF_HasSoundBudget(IClient *client);
+
+/**
+ * @brief Returns the number of sounds sent to a client per snapshot, its own budget if it has one.
+ */
+int SSF_GetMaxSounds(IClient *client);
+
+/**
+ * @brief Fills an unreliable SVC_Sounds message from the client's queue and
+ * removes the sent sounds, like the engine does. Accounts the sound bits while
+ * sv_ssf_bandwidth is on. SSF_InitSounds must have succeeded.
+ *
+ * @param client		CGameClient.
+ * @param msg			SVC_Sounds message.
+ * @param bShare		Copy the prefix shared with the tick's first queue instead of encoding it.
+ * @return				Number of sounds written.
+ */
+int SSF_FillSoundsMessage(IClient *client, void *msg, bool bShare);
+
+/**
+ * @brief Returns the number of sounds queued for a client. SSF_InitSounds must have succeeded.
+ *
+ * @param client		CGameClient.
+ */
+int SSF_GetQueuedSounds(IClient *client);
+
+/**
+ * @brief Empties the client's queue and leaves the SVC_Sounds message empty,
+ * for clients nothing is sent to. SSF_InitSounds must have succeeded.
+ *
+ * @param client		CGameClient.
+ * @param msg			SVC_Sounds message.
+ * @return				Number of sounds written, always 0.
+ */
+int SSF_DropSounds(IClient *client, void *msg);
+
+/**
+ * @brief Empties the client's queue once the layout was verified, does nothing before.
+ *
+ * @param client		CGameClient.
+ */
+void SSF_ClearSounds(IClient *client);
+
+#endif // _INCLUDE_SSF_SOUNDS_H_
@@ -0,0 +1,161 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _INCLUDE_SSF_LOCK_H_
+#define _INCLUDE_SSF_LOCK_H_
+
+/**
+ * @file ssflock.h
+ * @brief Snapshot lock with a runtime selectable strategy.
+ */
+
+#if defined SSF_STANDALONE
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+// Stand-ins for the tier0 mutexes when built without the SDK (tools/ssf_replay.cpp)
+class SSFSpinMutex
+{
+public:
+	SSFSpinMutex() : m_bLocked(false)
+	{
+	}
+
+	void Lock()
+	{
+		for (int spins = 0; ; spins++)
+		{
+			if (!m_bLocked.load(std::memory_order_relaxed) && !m_bLocked.exchange(true, std::memory_order_acquire))
+				return;
+
+			if (spins >= 1000)
+				std::this_thread::yield();
+		}
+	}
+
+	void Unlock()
+	{
+		m_bLocked.store(false, std::memory_order_release);
+	}
+
+private:
+	std::atomic<bool>	m_bLocked;
+};
+
+class SSFBlockingMutex
+{
+public:
+	void Lock()
+	{
+		m_Mutex.lock();
+	}
+
+	void Unlock()
+	{
+		m_Mutex.unlock();
+	}
+
+private:
+	std::mutex	m_Mutex;
+};
+#else
+#include <threadtools.h>
+
+typedef CThreadFastMutex	SSFSpinMutex;
+typedef CThreadMutex		SSFBlockingMutex;
+#endif
+
+/**
+ * @brief Locking strategies, mirrors the sv_ssf_lock_mode values.
+ */
+enum SSFLockMode
+{
+	SSFLockMode_Spin = 0,		/**< SSFSpinMutex (CThreadFastMutex), spins then yields */
+	SSFLockMode_Blocking,		/**< SSFBlockingMutex (CThreadMutex), sleeps in the kernel */
+
+	SSFLockMode_Count
+};
+
+/**
+ * @brief Mutex whose strategy can be switched between frames.
+ * Works with AUTO_LOCK. The mode must only be changed while no thread can
+ * hold or wait for the lock, Unlock() relies on it being the same as in Lock().
+ */
+class SSFLock
+{
+public:
+	SSFLock() : m_Mode(SSFLockMode_Spin), m_bSerial(false)
+	{
+	}
+
+	void Lock()
+	{
+		if (m_bSerial)
+			return;
+
+		if (m_Mode == SSFLockMode_Blocking)
+			m_Blocking.Lock();
+		else
+			m_Spin.Lock();
+	}
+
+	void Unlock()
+	{
+		if (m_bSerial)
+			return;
+
+		if (m_Mode == SSFLockMode_Blocking)
+			m_Blocking.Unlock();
+		else
+			m_Spin.Unlock();
+	}
+
+	SSFLockMode GetMode() const
+	{
+		return m_Mode;
+	}
+
+	void SetMode(SSFLockMode mode)
+	{
+		m_Mode = mode;
+	}
+
+	bool IsSerial() const
+	{
+		return m_bSerial;
+	}
+
+	/**
+	 * @brief Turns Lock() and Unlock() into no-ops while every caller runs on one thread.
+	 * Same rule as SetMode().
+	 */
+	void SetSerial(bool serial)
+	{
+		m_bSerial = serial;
+	}
+
+private:
+	SSFLockMode			m_Mode;
+	bool				m_bSerial;
+	SSFSpinMutex		m_Spin;
+	SSFBlockingMutex	m_Blocking;
+};
+
+#endif // _INCLUDE_SSF_LOCK_H_
@@ -0,0 +1,174 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+
+#include "extension.h"
+#include "ssflog.h"
+#include <threadtools.h>
+
+#define SSFLOG_MAX_THREADS		64
+#define SSFLOG_RING_SIZE		1024	// records per thread, must be a power of two
+
+struct SSFLogRecord
+{
+	double		time;
+	uint32_t	thread;
+	uint16_t	event;
+	uint16_t	reserved;
+	int32_t		args[4];
+};
+
+// Single producer (owning thread), single consumer (main thread)
+struct SSFLogRing
+{
+	std::atomic<uint32_t>	head;		// next slot to write, owned by the producer
+	std::atomic<uint32_t>	tail;		// next slot to read, owned by the consumer
+	std::atomic<uint32_t>	dropped;
+	uint32_t				thread;
+	SSFLogRecord			records[SSFLOG_RING_SIZE];
+};
+
+static const char *s_LogFormats[SSFLog_NumEvents] =
+{
+	"WriteTempEntities client %d ev_max %d lock wait %d us call %d us",	// SSFLog_TempEntities
+	"Detour %d client %d waited %d us for the snapshot lock",			// SSFLog_LockWait
+	"Snapshot overflow for client %d (%d bits)",						// SSFLog_Overflow
+	"Send phase took %d us, deadline %d us, %d clients, heaviest slot %d",	// SSFLog_DeadlineMiss
+};
+
+volatile int g_iSSFLogLevel = SSFLogLevel_Off;
+
+static std::atomic<SSFLogRing *> s_Rings[SSFLOG_MAX_THREADS];
+static std::atomic<int> s_nRings(0);
+static std::atomic<uint32_t> s_nLostThreads(0);
+static thread_local SSFLogRing *s_pThreadRing = NULL;
+static thread_local bool s_bThreadRingFailed = false;
+
+static SSFLogRing *SSFLog_GetThreadRing()
+{
+	if (s_pThreadRing || s_bThreadRingFailed)
+		return s_pThreadRing;
+
+	int index = s_nRings.fetch_add(1);
+	if (index >= SSFLOG_MAX_THREADS)
+	{
+		s_nRings.store(SSFLOG_MAX_THREADS);
+		s_nLostThreads.fetch_add(1, std::memory_order_relaxed);
+		s_bThreadRingFailed = true;
+		return NULL;
+	}
+
+	SSFLogRing *ring = new SSFLogRing;
+	ring->head.store(0, std::memory_order_relaxed);
+	ring->tail.store(0, std::memory_order_relaxed);
+	ring->dropped.store(0, std::memory_order_relaxed);
+	ring->thread = (uint32_t)ThreadGetCurrentId();
+
+	s_Rings[index].store(ring, std::memory_order_release);
+	s_pThreadRing = ring;
+
+	return ring;
+}
+
+void SSFLog_Write(SSFLogEvent event, int a, int b, int c, int d)
+{
+	SSFLogRing *ring = SSFLog_GetThreadRing();
+	if (!ring)
+		return;
+
+	uint32_t head = ring->head.load(std::memory_order_relaxed);
+	uint32_t tail = ring->tail.load(std::memory_order_acquire);
+	if (head - tail >= SSFLOG_RING_SIZE)
+	{
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	SSFLogRecord &record = ring->records[head & (SSFLOG_RING_SIZE - 1)];
+	record.time = Plat_FloatTime();
+	record.thread = ring->thread;
+	record.event = (uint16_t)event;
+	record.args[0] = a;
+	record.args[1] = b;
+	record.args[2] = c;
+	record.args[3] = d;
+
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+void SSFLog_Flush(int level)
+{
+	g_iSSFLogLevel = level;
+
+	int nRings = s_nRings.load(std::memory_order_acquire);
+	if (nRings > SSFLOG_MAX_THREADS)
+		nRings = SSFLOG_MAX_THREADS;
+
+	for (int i = 0; i < nRings; i++)
+	{
+		SSFLogRing *ring = s_Rings[i].load(std::memory_order_acquire);
+		if (!ring)
+			continue;
+
+		uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+		uint32_t head = ring->head.load(std::memory_order_acquire);
+
+		char message[256];
+		for (; tail != head; tail++)
+		{
+			const SSFLogRecord &record = ring->records[tail & (SSFLOG_RING_SIZE - 1)];
+			if (record.event >= SSFLog_NumEvents)
+				continue;
+
+			int len = snprintf(message, sizeof(message), "[%.6f][%u] ", record.time, record.thread);
+			snprintf(&message[len], sizeof(message) - len, s_LogFormats[record.event],
+				record.args[0], record.args[1], record.args[2], record.args[3]);
+
+			g_pSM->LogMessage(myself, "%s", message);
+		}
+
+		ring->tail.store(tail, std::memory_order_release);
+
+		uint32_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+		if (dropped)
+		{
+			g_pSM->LogMessage(myself, "[%u] Dropped %u log records, ring is full", ring->thread, dropped);
+		}
+	}
+
+	uint32_t lost = s_nLostThreads.exchange(0, std::memory_order_relaxed);
+	if (lost)
+	{
+		g_pSM->LogMessage(myself, "%u threads could not get a log ring (limit %d)", lost, SSFLOG_MAX_THREADS);
+	}
+}
+
+void SSFLog_Shutdown()
+{
+	g_iSSFLogLevel = SSFLogLevel_Off;
+
+	for (int i = 0; i < SSFLOG_MAX_THREADS; i++)
+	{
+		SSFLogRing *ring = s_Rings[i].exchange(NULL);
+		delete ring;
+	}
+
+	s_nRings.store(0);
+}
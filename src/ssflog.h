@@ -0,0 +1,92 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _INCLUDE_SSF_LOG_H_
+#define _INCLUDE_SSF_LOG_H_
+
+/**
+ * @file ssflog.h
+ * @brief Asynchronous diagnostics logger.
+ *
+ * Hot-path code (detours running on sendsnapshot workers) only appends a
+ * fixed-size binary record to a ring owned by the calling thread. The main
+ * thread drains every ring once per frame, formats the records and hands
+ * them to the SourceMod logger, so no file I/O ever happens under the
+ * snapshot mutex.
+ */
+
+#include <stdint.h>
+
+/**
+ * @brief Record types. Each one has a matching format string in ssflog.cpp
+ * which receives the four integer arguments of the record in order.
+ */
+enum SSFLogEvent
+{
+	SSFLog_TempEntities = 0,	/**< client, ev_max, lock wait (us), call time (us) */
+	SSFLog_LockWait,			/**< SSFDetour, client, lock wait (us) */
+	SSFLog_Overflow,			/**< client, bits written */
+	SSFLog_DeadlineMiss,		/**< send phase (us), deadline (us), clients, slot of the most expensive client */
+
+	SSFLog_NumEvents
+};
+
+/**
+ * @brief Verbosity, mirrors the sv_ssf_log values.
+ */
+enum SSFLogLevel
+{
+	SSFLogLevel_Off = 0,
+	SSFLogLevel_Events,			/**< Slow lock waits, overflows and other notable events */
+	SSFLogLevel_Verbose,		/**< Every detour call */
+};
+
+/**
+ * @brief Current verbosity, refreshed by SSFLog_Flush() once per frame.
+ */
+extern volatile int g_iSSFLogLevel;
+
+/**
+ * @brief Appends a record to the calling thread's ring.
+ * Lock-free, never blocks and never allocates after the first call on a thread.
+ * Records are dropped (and counted) when the ring is full.
+ */
+void SSFLog_Write(SSFLogEvent event, int a = 0, int b = 0, int c = 0, int d = 0);
+
+/**
+ * @brief Drains and formats every pending record. Main thread only.
+ *
+ * @param level		Verbosity to use from now on.
+ */
+void SSFLog_Flush(int level);
+
+/**
+ * @brief Frees all rings. Must be called once no other thread can log anymore.
+ */
+void SSFLog_Shutdown();
+
+/**
+ * @brief Returns true if records of the given level should be written.
+ */
+inline bool SSFLog_Enabled(SSFLogLevel level)
+{
+	return g_iSSFLogLevel >= level;
+}
+
+#endif // _INCLUDE_SSF_LOG_H_
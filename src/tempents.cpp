@@ -0,0 +1,219 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "tempents.h"
+
+static int s_iTempEntitiesOffset = -1;
+static int s_iNumTempEntitiesOffset = -1;
+static int s_iTickCountOffset = -1;
+
+SSFTempEntTable g_TempEntTable;
+SSFTempEntTableStats g_TempEntTableStats;
+std::atomic<uint32_t> g_nSnapshotsCreated(0);
+
+bool SSF_InitTempEnts(IGameConfig *pGameConf)
+{
+	if (!pGameConf->GetOffset("CFrameSnapshot::m_nTickCount", &s_iTickCountOffset)
+		|| !pGameConf->GetOffset("CFrameSnapshot::m_pTempEntities", &s_iTempEntitiesOffset)
+		|| !pGameConf->GetOffset("CFrameSnapshot::m_nTempEntities", &s_iNumTempEntitiesOffset))
+	{
+		s_iTickCountOffset = -1;
+		s_iTempEntitiesOffset = -1;
+		s_iNumTempEntitiesOffset = -1;
+		return false;
+	}
+
+	return true;
+}
+
+int SSF_GetSnapshotTick(CFrameSnapshot *pSnapshot)
+{
+	if (!pSnapshot || s_iTickCountOffset < 0)
+		return -1;
+
+	return *reinterpret_cast<int *>(reinterpret_cast<unsigned char *>(pSnapshot) + s_iTickCountOffset);
+}
+
+int SSF_GetSnapshotTempEnts(CFrameSnapshot *pSnapshot, CEventInfo **&pEvents)
+{
+	pEvents = NULL;
+
+	if (!pSnapshot || s_iTempEntitiesOffset < 0)
+		return 0;
+
+	unsigned char *pBase = reinterpret_cast<unsigned char *>(pSnapshot);
+	int count = *reinterpret_cast<int *>(pBase + s_iNumTempEntitiesOffset);
+	if (count <= 0)
+		return 0;
+
+	pEvents = *reinterpret_cast<CEventInfo ***>(pBase + s_iTempEntitiesOffset);
+	return pEvents ? count : 0;
+}
+
+bool SSF_TempEntIncludesClient(CEventInfo *pEvent, int client)
+{
+	IRecipientFilter &filter = pEvent->GetFilter();
+
+	int count = filter.GetRecipientCount();
+	for (int i = 0; i < count; i++)
+	{
+		if (filter.GetRecipientIndex(i) == client)
+			return true;
+	}
+
+	return false;
+}
+
+void SSF_BuildTempEntTable(CFrameSnapshot *pSnapshot, bool bCounted)
+{
+	SSFTempEntTable &table = g_TempEntTable;
+	int previous = table.pSnapshot ? table.count : 0;
+
+	table.pSnapshot = NULL;
+	table.count = 0;
+	table.bEnabled = pSnapshot != NULL;
+
+	// Only clear the rows the last snapshot used, the rest stays zero
+	for (int w = 0; w < SSF_TE_CLIENT_WORDS; w++)
+	{
+		memset(table.recipients[w], 0, previous * sizeof(uint64_t));
+	}
+
+	table.iHistory = (table.iHistory + 1) % SSF_TE_HISTORY;
+
+	SSFTempEntHistory &entry = table.history[table.iHistory];
+	entry.pSnapshot = NULL;
+	entry.tick = -1;
+	entry.nCreated = g_nSnapshotsCreated.load(std::memory_order_relaxed);
+	entry.bCounted = bCounted;
+	memset(entry.anyRecipients, 0, sizeof(entry.anyRecipients));
+
+	CEventInfo **pEvents;
+	int count = SSF_GetSnapshotTempEnts(pSnapshot, pEvents);
+	if (!pSnapshot || count > SSF_TE_MAX_EVENTS || SSF_GetSnapshotTick(pSnapshot) < 0)
+		return;
+
+	for (int i = 0; i < count; i++)
+	{
+		CEventInfo *pEvent = pEvents[i];
+		if (!pEvent)
+		{
+			table.classID[i] = -1;
+			table.bits[i] = 0;
+			table.pClass[i] = NULL;
+			continue;
+		}
+
+		table.classID[i] = pEvent->classID;
+		table.bits[i] = pEvent->bits;
+		table.pClass[i] = pEvent->pClientClass;
+
+		IRecipientFilter &filter = pEvent->GetFilter();
+
+		int recipients = filter.GetRecipientCount();
+		for (int j = 0; j < recipients; j++)
+		{
+			int client = filter.GetRecipientIndex(j);
+			if (client < 0 || client > SSF_MAXCLIENTS)
+				continue;
+
+			table.recipients[client >> 6][i] |= (uint64_t)1 << (client & 63);
+			entry.anyRecipients[client >> 6] |= (uint64_t)1 << (client & 63);
+		}
+	}
+
+	table.pEvents = pEvents;
+	table.tick = SSF_GetSnapshotTick(pSnapshot);
+	table.count = count;
+	table.pSnapshot = pSnapshot;
+
+	entry.pSnapshot = pSnapshot;
+	entry.tick = table.tick;
+}
+
+bool SSF_TempEntTableExcludes(int client, CFrameSnapshot *pLastSnapshot)
+{
+	const SSFTempEntTable &table = g_TempEntTable;
+	if (client < 0 || client > SSF_MAXCLIENTS)
+		return false;
+
+	int word = client >> 6;
+	uint64_t bit = (uint64_t)1 << (client & 63);
+	int lastTick = SSF_GetSnapshotTick(pLastSnapshot);
+	int index = table.iHistory;
+
+	for (int n = 0; n < SSF_TE_HISTORY; n++)
+	{
+		const SSFTempEntHistory &entry = table.history[index];
+		if (!entry.pSnapshot || (entry.anyRecipients[word] & bit))
+			return false;
+
+		if (!pLastSnapshot)
+			return true;
+
+		// The previous table must be the snapshot created right before this one
+		int prev = (index + SSF_TE_HISTORY - 1) % SSF_TE_HISTORY;
+		const SSFTempEntHistory &previous = table.history[prev];
+		if (!entry.bCounted || !previous.bCounted || entry.nCreated - previous.nCreated != 1)
+			return false;
+
+		if (previous.pSnapshot == pLastSnapshot && previous.tick == lastTick)
+			return true;
+
+		index = prev;
+	}
+
+	return false;
+}
+
+bool SSF_IsTempEntTableFor(CFrameSnapshot *pSnapshot)
+{
+	const SSFTempEntTable &table = g_TempEntTable;
+	if (!pSnapshot || table.pSnapshot != pSnapshot || table.tick != SSF_GetSnapshotTick(pSnapshot))
+		return false;
+
+	CEventInfo **pEvents;
+	int count = SSF_GetSnapshotTempEnts(pSnapshot, pEvents);
+
+	return count == table.count && (!count || pEvents == table.pEvents);
+}
+
+void SSF_SelectTempEnts(int client, uint64_t *pSelected)
+{
+	const uint64_t *pRecipients = g_TempEntTable.recipients[client >> 6];
+	int shift = client & 63;
+	int words = (g_TempEntTable.count + 63) / 64;
+
+	// Branch-free over whole words, the recipients past count are zero
+	for (int w = 0; w < words; w++)
+	{
+		const uint64_t *pWord = &pRecipients[w * 64];
+		uint64_t mask = 0;
+
+		for (int i = 0; i < 64; i++)
+			mask |= ((pWord[i] >> shift) & 1) << i;
+
+		pSelected[w] = mask;
+	}
+
+	for (int w = words; w < SSF_TE_EVENT_WORDS; w++)
+		pSelected[w] = 0;
+}
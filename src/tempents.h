@@ -0,0 +1,193 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _INCLUDE_SSF_TEMPENTS_H_
+#define _INCLUDE_SSF_TEMPENTS_H_
+
+/**
+ * @file tempents.h
+ * @brief Read-only access to the tick and temp entities of a frame snapshot.
+ *
+ * The temp entities of the tick snapshot are also copied once per tick into
+ * a structure-of-arrays table, with the recipient filters flattened to one
+ * bitmask per client index word, so the per-client checks on the
+ * sendsnapshot workers never touch the CEventInfo objects or their filters.
+ * The engine attaches the temp entities to the tick snapshot before
+ * SV_ComputeClientPacks (CGameServer::SendClientMessages in sv_main.cpp), the
+ * table is built when it returns.
+ */
+
+#include <stdint.h>
+#include <atomic>
+
+#include "extension.h"
+#include "clientstate.h"
+#include <irecipientfilter.h>
+
+class CFrameSnapshot;
+class SendTable;
+class ServerClass;
+
+// engine/event_system.h
+class CEventInfo
+{
+public:
+	short					classID;
+	float					fire_delay;
+	const SendTable			*pSendTable;
+	const ServerClass		*pClientClass;	// ServerClass of the temp entity
+	int						bits;			// size of pData in bits
+	unsigned char			*pData;
+	int						flags;
+
+	// CEngineRecipientFilter, its IRecipientFilter base is at offset 0
+	IRecipientFilter &GetFilter()
+	{
+		return *reinterpret_cast<IRecipientFilter *>(&m_Filter);
+	}
+
+private:
+	void					*m_Filter;
+};
+
+/**
+ * @brief Loads the CFrameSnapshot offsets from the gamedata.
+ *
+ * @return		True if the tick and temp entities of a snapshot can be read.
+ */
+bool SSF_InitTempEnts(IGameConfig *pGameConf);
+
+/**
+ * @brief Returns the server tick of a snapshot.
+ *
+ * @param pSnapshot		Snapshot, must be referenced by the caller.
+ * @return				Tick, -1 if the snapshot is NULL or the offset is unavailable.
+ */
+int SSF_GetSnapshotTick(CFrameSnapshot *pSnapshot);
+
+/**
+ * @brief Returns the temp entities stored in a snapshot.
+ *
+ * @param pSnapshot		Snapshot, must be referenced by the caller.
+ * @param pEvents		Receives the event array, may be NULL if count is 0.
+ * @return				Number of events, 0 if the offsets are unavailable.
+ */
+int SSF_GetSnapshotTempEnts(CFrameSnapshot *pSnapshot, CEventInfo **&pEvents);
+
+/**
+ * @brief Same test as CGameClient::IgnoreTempEntity, inverted.
+ *
+ * @param pEvent		Event.
+ * @param client		Client index (player slot + 1).
+ */
+bool SSF_TempEntIncludesClient(CEventInfo *pEvent, int client);
+
+#define SSF_TE_MAX_EVENTS		512		// larger snapshots are not tabled
+#define SSF_TE_EVENT_WORDS		(SSF_TE_MAX_EVENTS / 64)
+#define SSF_TE_CLIENT_WORDS		((SSF_MAXCLIENTS + 64) / 64)	// client indices 0 to SSF_MAXCLIENTS
+#define SSF_TE_HISTORY			8		// last tabled snapshots, covers clients that missed ticks
+
+/**
+ * @brief Recipients of one tabled snapshot.
+ */
+struct SSFTempEntHistory
+{
+	CFrameSnapshot		*pSnapshot;		/**< NULL if the snapshot was not tabled */
+	int					tick;
+	uint32_t			nCreated;		/**< g_nSnapshotsCreated when it was tabled */
+	bool				bCounted;		/**< Every snapshot created since the previous table was counted */
+	uint64_t			anyRecipients[SSF_TE_CLIENT_WORDS];		/**< Clients receiving at least one event */
+};
+
+/**
+ * @brief Temp entities of one snapshot. Built on the main thread before the
+ * send phase, read-only while the sendsnapshot workers run.
+ */
+struct SSFTempEntTable
+{
+	CFrameSnapshot		*pSnapshot;		/**< NULL if no snapshot is tabled */
+	CEventInfo			**pEvents;		/**< Temp entity array of the snapshot when tabled */
+	bool				bEnabled;		/**< sv_ssf_tempent_table was on at the last build */
+	int					tick;
+	int					count;
+	int					iHistory;		/**< Entry of the current snapshot */
+	SSFTempEntHistory	history[SSF_TE_HISTORY];
+
+	short				classID[SSF_TE_MAX_EVENTS];
+	int					bits[SSF_TE_MAX_EVENTS];
+	const ServerClass	*pClass[SSF_TE_MAX_EVENTS];
+	uint64_t			recipients[SSF_TE_CLIENT_WORDS][SSF_TE_MAX_EVENTS];	/**< Zero past count */
+};
+
+extern SSFTempEntTable g_TempEntTable;
+
+/**
+ * @brief WriteTempEntities calls of game clients while the table is on.
+ */
+struct SSFTempEntTableStats
+{
+	std::atomic<uint32_t>	nCalls;
+	std::atomic<uint32_t>	nSkipped;		/**< Lock and engine call skipped */
+	std::atomic<uint32_t>	nUntabled;		/**< The current snapshot did not match the table */
+};
+
+extern SSFTempEntTableStats g_TempEntTableStats;
+
+/**
+ * @brief Snapshots created so far, counted by the CreateEmptySnapshot detour under the snapshot lock.
+ */
+extern std::atomic<uint32_t> g_nSnapshotsCreated;
+
+/**
+ * @brief Tables the temp entities of the tick snapshot. Main thread only,
+ * no sendsnapshot worker may run.
+ *
+ * @param pSnapshot		Tick snapshot, NULL to clear the table.
+ * @param bCounted		Whether the CreateEmptySnapshot detour counted the snapshots created this frame.
+ */
+void SSF_BuildTempEntTable(CFrameSnapshot *pSnapshot, bool bCounted);
+
+/**
+ * @brief Returns whether the table holds the current temp entities of a snapshot.
+ * Compares the snapshot, its tick and its temp entity array, a table built
+ * before the engine attached the events is never used.
+ */
+bool SSF_IsTempEntTableFor(CFrameSnapshot *pSnapshot);
+
+/**
+ * @brief Returns whether WriteTempEntities would write nothing for a client.
+ * The engine walks every snapshot after the client's last one up to the current
+ * one, this holds if they were all tabled in a row and none includes the client.
+ * The table must be valid for the current snapshot.
+ *
+ * @param client		Client index (player slot + 1).
+ * @param pLastSnapshot	Last snapshot sent to the client, NULL if only the current one is walked.
+ */
+bool SSF_TempEntTableExcludes(int client, CFrameSnapshot *pLastSnapshot);
+
+/**
+ * @brief Builds the bitmask of tabled events that include a client, in event order.
+ * The table must be valid.
+ *
+ * @param client		Client index (player slot + 1).
+ * @param pSelected		Receives SSF_TE_EVENT_WORDS words, bit i set if event i includes the client.
+ */
+void SSF_SelectTempEnts(int client, uint64_t *pSelected);
+
+#endif // _INCLUDE_SSF_TEMPENTS_H_
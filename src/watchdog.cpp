@@ -0,0 +1,334 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "watchdog.h"
+#include "convarhelper.h"
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+#if defined PLATFORM_POSIX
+#include <errno.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#define SSF_WATCHDOG_MAX_FRAMES		32
+#define SSF_WATCHDOG_SIGNAL_WAIT	0.1		// seconds to wait for the holder's backtrace
+
+extern CGlobalVars *gpGlobals;
+
+ConVar *g_SvSSFWatchdog = CreateConVar("sv_ssf_watchdog_ms", "0", FCVAR_NOTIFY, "Log the holder and a backtrace when the snapshot lock is held longer than this many milliseconds. 0 = disabled. Diagnostic only: the backtrace is taken in a signal handler and can deadlock the holder if it was interrupted inside the dynamic loader (dlopen, dl_iterate_phdr).");
+ConVar *g_SvSSFWatchdogInterval = CreateConVar("sv_ssf_watchdog_interval", "10", FCVAR_NOTIFY, "Minimum seconds between two long-hold reports.");
+
+volatile bool g_bSSFWatchdog = false;
+
+// Current holder. Written by the holder under the lock, sampled by the watchdog thread.
+// s_nHoldSeq changes on every acquire, a sample is only valid if it did not change while reading.
+static std::atomic<uint32_t> s_nHoldSeq(0);
+static std::atomic<int64_t> s_nHoldStartUs(0);		// 0 = not held
+static std::atomic<int> s_iHoldDetour(0);
+static std::atomic<int> s_iHoldClient(0);
+
+// The lock is recursive, ReleaseReference runs inside WriteTempEntities. Only the outermost hold is published.
+static thread_local int s_iHoldDepth = 0;
+
+void SSF_Watchdog_Release()
+{
+	if (--s_iHoldDepth > 0)
+		return;
+
+	s_nHoldStartUs.store(0, std::memory_order_release);
+}
+
+#if defined PLATFORM_POSIX
+enum SSFReportState
+{
+	SSFReport_Free = 0,		/**< Watchdog thread may start a report */
+	SSFReport_Signaled,		/**< Waiting for the holder's signal handler */
+	SSFReport_Writing,		/**< Signal handler is writing the backtrace */
+	SSFReport_Ready,		/**< Main thread may log it */
+};
+
+struct SSFHoldReport
+{
+	std::atomic<int>	state;
+	uint32_t			seq;
+	uint32_t			thread;
+	int					detour;
+	int					client;
+	double				holdTime;
+	bool				bStillHeld;		/**< Holder was still inside the same hold when signaled */
+	int					nFrames;
+	void				*frames[SSF_WATCHDOG_MAX_FRAMES];
+};
+
+static const char *s_DetourNames[SSFDetour_Count] =
+{
+	"WriteTempEntities",	// SSFDetour_WriteTempEntities
+	"ReleaseReference",		// SSFDetour_ReleaseReference
+	"CreateEmptySnapshot",	// SSFDetour_CreateEmptySnapshot
+};
+
+static SSFHoldReport s_Report;
+static std::atomic<pthread_t> s_HoldThread;
+static std::atomic<uint32_t> s_nSuppressed(0);
+static std::atomic<int64_t> s_nThresholdUs(0);
+static std::atomic<int64_t> s_nIntervalUs(0);
+static std::atomic<bool> s_bRunning(false);
+static pthread_t s_WatchdogThread;
+static struct sigaction s_OldAction;
+
+// Real-time signals are not used by the engine, glibc reserves the ones below SIGRTMIN
+static inline int GetWatchdogSignal()
+{
+	return SIGRTMIN + 4;
+}
+
+static inline int64_t GetTimeUs()
+{
+	return (int64_t)(Plat_FloatTime() * 1000000.0);
+}
+
+void SSF_Watchdog_Acquire(SSFDetour detour, int client, double flLocked)
+{
+	if (s_iHoldDepth++ > 0)
+		return;
+
+	s_iHoldDetour.store(detour, std::memory_order_relaxed);
+	s_iHoldClient.store(client, std::memory_order_relaxed);
+	s_HoldThread.store(pthread_self(), std::memory_order_relaxed);
+	s_nHoldSeq.fetch_add(1, std::memory_order_release);
+	s_nHoldStartUs.store((int64_t)(flLocked * 1000000.0), std::memory_order_release);
+}
+
+// Runs on the holder. backtrace() was primed at start, it does not allocate anymore,
+// but the unwinder still takes the loader lock through dl_iterate_phdr. A holder
+// interrupted while it owns that lock never returns from here.
+static void WatchdogSignalHandler(int sig)
+{
+	int expected = SSFReport_Signaled;
+	if (!s_Report.state.compare_exchange_strong(expected, SSFReport_Writing))
+		return;
+
+	int savedErrno = errno;
+
+	s_Report.bStillHeld = s_nHoldSeq.load(std::memory_order_acquire) == s_Report.seq
+		&& s_nHoldStartUs.load(std::memory_order_acquire) != 0;
+	s_Report.nFrames = backtrace(s_Report.frames, SSF_WATCHDOG_MAX_FRAMES);
+
+	s_Report.state.store(SSFReport_Ready, std::memory_order_release);
+
+	errno = savedErrno;
+}
+
+static void *WatchdogThread(void *)
+{
+	uint32_t lastSeq = 0;
+	int64_t nextReportUs = 0;
+
+	while (s_bRunning.load(std::memory_order_acquire))
+	{
+		int64_t thresholdUs = s_nThresholdUs.load(std::memory_order_relaxed);
+		usleep((useconds_t)(thresholdUs / 4 > 1000 ? thresholdUs / 4 : 1000));
+
+		uint32_t seq = s_nHoldSeq.load(std::memory_order_acquire);
+		int64_t startUs = s_nHoldStartUs.load(std::memory_order_acquire);
+		int detour = s_iHoldDetour.load(std::memory_order_relaxed);
+		int client = s_iHoldClient.load(std::memory_order_relaxed);
+		pthread_t holder = s_HoldThread.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if (!startUs || seq == lastSeq || seq != s_nHoldSeq.load(std::memory_order_acquire))
+			continue;
+
+		int64_t nowUs = GetTimeUs();
+		if (nowUs - startUs < thresholdUs)
+			continue;
+
+		// One report per hold
+		lastSeq = seq;
+
+		if (nowUs < nextReportUs || s_Report.state.load(std::memory_order_acquire) != SSFReport_Free)
+		{
+			s_nSuppressed.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+		nextReportUs = nowUs + s_nIntervalUs.load(std::memory_order_relaxed);
+
+		s_Report.seq = seq;
+		s_Report.thread = (uint32_t)(uintptr_t)holder;
+		s_Report.detour = detour;
+		s_Report.client = client;
+		s_Report.holdTime = (nowUs - startUs) / 1000000.0;
+		s_Report.bStillHeld = false;
+		s_Report.nFrames = 0;
+		s_Report.state.store(SSFReport_Signaled, std::memory_order_release);
+
+		// Engine workers and the main thread outlive the hold, the holder is still alive here
+		if (pthread_kill(holder, GetWatchdogSignal()) == 0)
+		{
+			double flGiveUp = Plat_FloatTime() + SSF_WATCHDOG_SIGNAL_WAIT;
+			while (s_Report.state.load(std::memory_order_acquire) == SSFReport_Signaled && Plat_FloatTime() < flGiveUp)
+				usleep(1000);
+		}
+
+		// Publish without a backtrace if the handler never ran
+		int expected = SSFReport_Signaled;
+		s_Report.state.compare_exchange_strong(expected, SSFReport_Ready);
+	}
+
+	return NULL;
+}
+
+static bool SSF_Watchdog_Start()
+{
+	// The first call loads the unwinder, keep that out of the signal handler
+	void *frames[1];
+	backtrace(frames, 1);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = WatchdogSignalHandler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+
+	if (sigaction(GetWatchdogSignal(), &action, &s_OldAction) != 0)
+	{
+		g_pSM->LogError(myself, "Could not install the watchdog signal handler: %s", strerror(errno));
+		return false;
+	}
+
+	s_Report.state.store(SSFReport_Free);
+	s_nHoldStartUs.store(0);
+	s_nSuppressed.store(0);
+	s_bRunning.store(true);
+
+	if (pthread_create(&s_WatchdogThread, NULL, WatchdogThread, NULL) != 0)
+	{
+		g_pSM->LogError(myself, "Could not start the watchdog thread.");
+		s_bRunning.store(false);
+		sigaction(GetWatchdogSignal(), &s_OldAction, NULL);
+		return false;
+	}
+
+	g_bSSFWatchdog = true;
+	return true;
+}
+
+void SSF_Watchdog_Stop()
+{
+	if (!s_bRunning.load())
+		return;
+
+	g_bSSFWatchdog = false;
+	s_bRunning.store(false);
+	pthread_join(s_WatchdogThread, NULL);
+
+	// Ignore rather than fall back to the default action (terminate) in case a
+	// late signal is still on its way to a holder
+	if (s_OldAction.sa_handler == SIG_DFL)
+		s_OldAction.sa_handler = SIG_IGN;
+	sigaction(GetWatchdogSignal(), &s_OldAction, NULL);
+	s_Report.state.store(SSFReport_Free);
+}
+
+static void LogReport()
+{
+	char name[64] = "";
+	if (s_Report.client > 0)
+	{
+		IGamePlayer *pPlayer = playerhelpers->GetGamePlayer(s_Report.client);
+		snprintf(name, sizeof(name), " \"%s\"", (pPlayer && pPlayer->IsConnected()) ? pPlayer->GetName() : "<disconnected>");
+	}
+
+	const char *detour = (s_Report.detour >= 0 && s_Report.detour < SSFDetour_Count) ? s_DetourNames[s_Report.detour] : "?";
+	uint32_t suppressed = s_nSuppressed.exchange(0, std::memory_order_relaxed);
+
+	g_pSM->LogMessage(myself, "Snapshot lock held for %.1f ms by thread %u in %s, client %d%s, map %s, tick %d (%u more long holds not reported)",
+		s_Report.holdTime * 1000.0, s_Report.thread, detour, s_Report.client, name,
+		gamehelpers->GetCurrentMap(), gpGlobals->tickcount, suppressed);
+
+	if (!s_Report.nFrames)
+	{
+		g_pSM->LogMessage(myself, "  no backtrace, the holder did not answer the signal");
+		return;
+	}
+
+	if (!s_Report.bStillHeld)
+	{
+		g_pSM->LogMessage(myself, "  the hold was over when the backtrace was taken:");
+	}
+
+	char **symbols = backtrace_symbols(s_Report.frames, s_Report.nFrames);
+
+	// Frame 0 and 1 are the signal handler and the signal trampoline
+	for (int i = 2; i < s_Report.nFrames; i++)
+	{
+		g_pSM->LogMessage(myself, "  #%d %s", i - 2, symbols ? symbols[i] : "?");
+	}
+
+	free(symbols);
+}
+
+void SSF_Watchdog_Frame()
+{
+	float threshold = g_SvSSFWatchdog->GetFloat();
+
+	if (threshold <= 0.0f)
+	{
+		SSF_Watchdog_Stop();
+		return;
+	}
+
+	s_nThresholdUs.store((int64_t)(threshold * 1000.0f), std::memory_order_relaxed);
+	s_nIntervalUs.store((int64_t)(g_SvSSFWatchdogInterval->GetFloat() * 1000000.0f), std::memory_order_relaxed);
+
+	if (!s_bRunning.load() && !SSF_Watchdog_Start())
+	{
+		g_SvSSFWatchdog->SetValue(0);
+		return;
+	}
+
+	if (s_Report.state.load(std::memory_order_acquire) == SSFReport_Ready)
+	{
+		LogReport();
+		s_Report.state.store(SSFReport_Free, std::memory_order_release);
+	}
+}
+#else
+void SSF_Watchdog_Acquire(SSFDetour detour, int client, double flLocked)
+{
+	s_iHoldDepth++;
+}
+
+void SSF_Watchdog_Frame()
+{
+	if (g_SvSSFWatchdog->GetFloat() > 0.0f)
+	{
+		g_pSM->LogError(myself, "The snapshot lock watchdog is only supported on Linux.");
+		g_SvSSFWatchdog->SetValue(0);
+	}
+}
+
+void SSF_Watchdog_Stop()
+{
+}
+#endif
@@ -0,0 +1,64 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _INCLUDE_SSF_WATCHDOG_H_
+#define _INCLUDE_SSF_WATCHDOG_H_
+
+/**
+ * @file watchdog.h
+ * @brief Long-hold watchdog for the snapshot lock.
+ *
+ * Detours publish the current holder (thread, detour, client, acquire time)
+ * right after taking the lock. A watchdog thread polls it and, once a hold
+ * passes sv_ssf_watchdog_ms, signals the holder to grab its backtrace. The
+ * main thread logs the report, at most one per sv_ssf_watchdog_interval.
+ */
+
+#include "extension.h"
+
+/**
+ * @brief Watchdog switch, holds must only be published while true.
+ */
+extern volatile bool g_bSSFWatchdog;
+
+/**
+ * @brief Publishes the calling thread as the lock holder. Call with the lock held.
+ *
+ * @param detour		Detour holding the lock.
+ * @param client		Client index, 0 if none.
+ * @param flLocked		Plat_FloatTime() when the lock was taken.
+ */
+void SSF_Watchdog_Acquire(SSFDetour detour, int client, double flLocked);
+
+/**
+ * @brief Clears the published holder. Call before releasing the lock.
+ */
+void SSF_Watchdog_Release();
+
+/**
+ * @brief Starts or stops the watchdog from its cvars and logs pending reports. Main thread only.
+ */
+void SSF_Watchdog_Frame();
+
+/**
+ * @brief Stops the watchdog thread. Main thread only.
+ */
+void SSF_Watchdog_Stop();
+
+#endif // _INCLUDE_SSF_WATCHDOG_H_
@@ -0,0 +1,528 @@
+/**
+ * vim: set ts=4 :
+ * =============================================================================
+ * SendSnapshotFixer
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 3.0, as published by the
+ * Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file ssf_replay.cpp
+ * @brief Offline replayer for captures written by sm_ssf_capture.
+ *
+ * Rebuilds the per-tick sendsnapshot work of a capture (each client's send
+ * time and the part of it spent under the snapshot lock) and runs it on a
+ * worker pool through the extension's own SSFLock and send ordering, once
+ * per lock mode and send order. Compare the frame makespans to judge a
+ * change against real traffic.
+ *
+ * Build: g++ -O2 -std=c++14 -pthread -DSSF_STANDALONE -Isrc tools/ssf_replay.cpp -o ssf_replay
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "capture.h"
+#include "ssflock.h"
+#include "schedule.h"
+
+#define REPLAY_MAX_CLIENTS		256
+#define REPLAY_MAX_THREADS		256		// SSFCaptureRecord::thread
+
+struct ReplayJob
+{
+	int			client;
+	uint32_t	sendUs;		// whole SendSnapshot
+	uint32_t	lockedUs;	// spent in detours under the snapshot lock
+};
+
+struct ReplayTick
+{
+	int						tick;
+	uint32_t				makespanUs;		// as captured
+	std::vector<ReplayJob>	jobs;
+};
+
+struct ReplayResult
+{
+	std::vector<double>	makespans;	// microseconds
+	double				lockWaitUs;
+};
+
+typedef std::chrono::steady_clock ReplayClock;
+
+static inline double ElapsedUs(ReplayClock::time_point start, ReplayClock::time_point end)
+{
+	return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+static void BusyWait(double us)
+{
+	if (us <= 0.0)
+		return;
+
+	ReplayClock::time_point end = ReplayClock::now() + std::chrono::nanoseconds((long long)(us * 1000.0));
+	while (ReplayClock::now() < end)
+		;
+}
+
+static bool LoadCapture(const char *path, SSFCaptureHeader &header, std::vector<SSFCaptureRecord> &records)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+	{
+		fprintf(stderr, "Could not open %s\n", path);
+		return false;
+	}
+
+	if (fread(&header, sizeof(header), 1, file) != 1
+		|| header.magic != SSF_CAPTURE_MAGIC
+		|| header.version != SSF_CAPTURE_VERSION
+		|| header.recordSize != sizeof(SSFCaptureRecord))
+	{
+		fprintf(stderr, "%s is not a version %d capture\n", path, SSF_CAPTURE_VERSION);
+		fclose(file);
+		return false;
+	}
+
+	records.resize(header.numRecords);
+	size_t count = header.numRecords ? fread(&records[0], sizeof(SSFCaptureRecord), header.numRecords, file) : 0;
+	records.resize(count);
+	fclose(file);
+
+	if (count != header.numRecords)
+	{
+		fprintf(stderr, "Warning: capture truncated, %u of %u records read\n", (unsigned)count, header.numRecords);
+	}
+
+	return true;
+}
+
+struct ReplayHold
+{
+	uint32_t	timeUs;
+	uint32_t	callUs;
+};
+
+static void BuildTicks(const std::vector<SSFCaptureRecord> &records, std::vector<ReplayTick> &ticks)
+{
+	int jobIndex[REPLAY_MAX_CLIENTS];
+	uint32_t frameStart = 0;
+
+	// Lock holds are charged to the next SendSnapshot finishing on the same thread,
+	// ReleaseReference and CreateEmptySnapshot do not know the client they run for
+	uint32_t lockedUs[REPLAY_MAX_THREADS];
+
+	// ReleaseReference holds not charged yet. The ones made by the engine inside
+	// WriteTempEntities are part of its call time, its record is written after them.
+	std::vector<ReplayHold> releases[REPLAY_MAX_THREADS];
+
+	memset(lockedUs, 0, sizeof(lockedUs));
+
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		const SSFCaptureRecord &record = records[i];
+
+		switch (record.type)
+		{
+			case SSFCapture_Frame:
+			{
+				ticks.push_back(ReplayTick());
+				ticks.back().tick = record.tick;
+				ticks.back().makespanUs = 0;
+				frameStart = record.timeUs;
+
+				for (int client = 0; client < REPLAY_MAX_CLIENTS; client++)
+					jobIndex[client] = -1;
+				memset(lockedUs, 0, sizeof(lockedUs));
+				for (int thread = 0; thread < REPLAY_MAX_THREADS; thread++)
+					releases[thread].clear();
+				break;
+			}
+			case SSFCapture_CreateEmptySnapshot:
+			{
+				lockedUs[record.thread] += record.callUs;
+				break;
+			}
+			case SSFCapture_ReleaseReference:
+			{
+				ReplayHold hold;
+				hold.timeUs = record.timeUs;
+				hold.callUs = record.callUs;
+				releases[record.thread].push_back(hold);
+
+				lockedUs[record.thread] += record.callUs;
+				break;
+			}
+			case SSFCapture_WriteTempEntities:
+			{
+				std::vector<ReplayHold> &held = releases[record.thread];
+				uint32_t nestedUs = 0;
+
+				for (size_t j = 0; j < held.size(); )
+				{
+					if (held[j].timeUs >= record.timeUs && held[j].timeUs - record.timeUs <= record.waitUs + record.callUs)
+					{
+						nestedUs += held[j].callUs;
+						held.erase(held.begin() + j);
+					}
+					else
+					{
+						j++;
+					}
+				}
+
+				lockedUs[record.thread] -= nestedUs;
+				lockedUs[record.thread] += record.callUs;
+				break;
+			}
+			case SSFCapture_SendSnapshot:
+			{
+				if (ticks.empty() || record.client >= REPLAY_MAX_CLIENTS)
+					break;
+
+				ReplayTick &tick = ticks.back();
+
+				if (jobIndex[record.client] < 0)
+				{
+					jobIndex[record.client] = (int)tick.jobs.size();
+					tick.jobs.push_back(ReplayJob());
+					tick.jobs.back().client = record.client;
+					tick.jobs.back().sendUs = 0;
+					tick.jobs.back().lockedUs = 0;
+				}
+
+				ReplayJob &job = tick.jobs[jobIndex[record.client]];
+				job.sendUs += record.callUs;
+				job.lockedUs += lockedUs[record.thread];
+				lockedUs[record.thread] = 0;
+				releases[record.thread].clear();
+
+				uint32_t end = record.timeUs + record.callUs;
+				if (end > frameStart && end - frameStart > tick.makespanUs)
+					tick.makespanUs = end - frameStart;
+				break;
+			}
+		}
+	}
+
+	// Slot order, as the engine builds the array
+	for (size_t i = 0; i < ticks.size(); i++)
+	{
+		std::vector<ReplayJob> &jobs = ticks[i].jobs;
+		std::sort(jobs.begin(), jobs.end(), [](const ReplayJob &a, const ReplayJob &b) { return a.client < b.client; });
+	}
+}
+
+static void PrintCaptureSummary(const SSFCaptureHeader &header, const std::vector<SSFCaptureRecord> &records, const std::vector<ReplayTick> &ticks)
+{
+	uint64_t counts[SSFCapture_NumTypes] = {};
+	uint64_t waitUs[SSFCapture_NumTypes] = {};
+	uint64_t callUs[SSFCapture_NumTypes] = {};
+	uint64_t tempEnts = 0, sounds = 0, jobs = 0;
+
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		const SSFCaptureRecord &record = records[i];
+		if (record.type >= SSFCapture_NumTypes)
+			continue;
+
+		counts[record.type]++;
+		waitUs[record.type] += record.waitUs;
+		callUs[record.type] += record.callUs;
+
+		if (record.type == SSFCapture_WriteTempEntities)
+			tempEnts += record.data[0];
+		else if (record.type == SSFCapture_Sounds)
+			sounds += record.data[1];
+	}
+
+	for (size_t i = 0; i < ticks.size(); i++)
+		jobs += ticks[i].jobs.size();
+
+	static const char *s_TypeNames[SSFCapture_NumTypes] =
+	{
+		"Frame", "CreateEmptySnapshot", "ReleaseReference", "WriteTempEntities", "SendSnapshot", "Sounds"
+	};
+
+	printf("Capture: %u records (%u dropped), %u ticks, tick interval %.4f s\n",
+		header.numRecords, header.droppedRecords, (unsigned)ticks.size(), header.tickInterval);
+
+	if (!ticks.empty())
+	{
+		printf("  %.1f clients per tick, %.1f temp entities per WriteTempEntities, %.1f sounds per tick\n",
+			(double)jobs / ticks.size(),
+			counts[SSFCapture_WriteTempEntities] ? (double)tempEnts / counts[SSFCapture_WriteTempEntities] : 0.0,
+			(double)sounds / ticks.size());
+	}
+
+	for (int type = 0; type < SSFCapture_NumTypes; type++)
+	{
+		if (!counts[type] || type == SSFCapture_Frame)
+			continue;
+
+		printf("  %-20s %10llu calls, mean lock wait %8.2f us, mean call %8.2f us\n", s_TypeNames[type],
+			(unsigned long long)counts[type], (double)waitUs[type] / counts[type], (double)callUs[type] / counts[type]);
+	}
+}
+
+class ReplayPool
+{
+public:
+	ReplayPool(int threads, double speed) : m_flSpeed(speed), m_iGeneration(0), m_bQuit(false), m_nIdle(0)
+	{
+		for (int i = 0; i < threads; i++)
+			m_Threads.push_back(std::thread(&ReplayPool::Worker, this));
+	}
+
+	~ReplayPool()
+	{
+		m_bQuit.store(true);
+		m_iGeneration.fetch_add(1);
+		for (size_t i = 0; i < m_Threads.size(); i++)
+			m_Threads[i].join();
+	}
+
+	// Runs one tick, returns its makespan in microseconds
+	double Run(SSFLock *pLock, const ReplayJob *jobs, int count, double *durations)
+	{
+		m_pLock = pLock;
+		m_pJobs = jobs;
+		m_pDurations = durations;
+		m_nJobs = count;
+		m_iNext.store(0);
+		m_nIdle.store(0);
+		m_flLockWaitUs.store(0);
+		m_Start = ReplayClock::now();
+
+		m_iGeneration.fetch_add(1, std::memory_order_release);
+
+		// Every job is done once every worker left the pull loop, the next
+		// tick may only replace the jobs after that
+		int threads = (int)m_Threads.size();
+		while (m_nIdle.load(std::memory_order_acquire) < threads)
+			std::this_thread::yield();
+
+		return ElapsedUs(m_Start, ReplayClock::now());
+	}
+
+	double GetLockWaitUs() const
+	{
+		return m_flLockWaitUs.load() / 1000.0;
+	}
+
+private:
+	void Worker()
+	{
+		int generation = 0;
+
+		for (;;)
+		{
+			while (m_iGeneration.load(std::memory_order_acquire) == generation)
+				std::this_thread::yield();
+
+			generation = m_iGeneration.load(std::memory_order_acquire);
+			if (m_bQuit.load())
+				return;
+
+			// Same distribution as ParallelProcess, every worker pulls the next item
+			int index;
+			while ((index = m_iNext.fetch_add(1)) < m_nJobs)
+			{
+				const ReplayJob &job = m_pJobs[index];
+				double lockedUs = job.lockedUs / m_flSpeed;
+				double unlockedUs = (job.sendUs > job.lockedUs ? job.sendUs - job.lockedUs : 0) / m_flSpeed;
+
+				ReplayClock::time_point start = ReplayClock::now();
+
+				// string tables and entity deltas, then temp entities under the lock, then sounds
+				BusyWait(unlockedUs * 2.0 / 3.0);
+
+				ReplayClock::time_point waitStart = ReplayClock::now();
+				m_pLock->Lock();
+				m_flLockWaitUs.fetch_add((int64_t)(ElapsedUs(waitStart, ReplayClock::now()) * 1000.0));
+				BusyWait(lockedUs);
+				m_pLock->Unlock();
+
+				BusyWait(unlockedUs / 3.0);
+
+				m_pDurations[index] = ElapsedUs(start, ReplayClock::now()) * m_flSpeed;
+			}
+
+			m_nIdle.fetch_add(1, std::memory_order_release);
+		}
+	}
+
+	double						m_flSpeed;
+	std::vector<std::thread>	m_Threads;
+	std::atomic<int>			m_iGeneration;
+	std::atomic<bool>			m_bQuit;
+	std::atomic<int>			m_iNext;
+	std::atomic<int>			m_nIdle;		// workers out of the pull loop this tick
+	std::atomic<int64_t>		m_flLockWaitUs;	// nanoseconds
+	SSFLock						*m_pLock;
+	const ReplayJob				*m_pJobs;
+	double						*m_pDurations;
+	int							m_nJobs;
+	ReplayClock::time_point		m_Start;
+};
+
+static void Replay(ReplayPool &pool, const std::vector<ReplayTick> &ticks, SSFLockMode mode, bool longestFirst, double speed, ReplayResult &result)
+{
+	SSFLock lock;
+	lock.SetMode(mode);
+
+	SSFSendCost costs[REPLAY_MAX_CLIENTS];
+	for (int i = 0; i < REPLAY_MAX_CLIENTS; i++)
+		costs[i].Reset();
+
+	std::vector<ReplayJob> jobs;
+	std::vector<float> priorities;
+	std::vector<double> durations;
+
+	result.makespans.clear();
+	result.lockWaitUs = 0.0;
+
+	for (size_t t = 0; t < ticks.size(); t++)
+	{
+		jobs = ticks[t].jobs;
+		if (jobs.empty())
+			continue;
+
+		priorities.resize(jobs.size());
+		durations.resize(jobs.size());
+
+		for (size_t i = 0; i < jobs.size(); i++)
+			priorities[i] = costs[jobs[i].client].GetPriority();
+
+		if (longestFirst && jobs.size() > 1)
+			SSF_SortLongestFirst(&jobs[0], &priorities[0], (int)jobs.size());
+
+		double makespan = pool.Run(&lock, &jobs[0], (int)jobs.size(), &durations[0]);
+		result.makespans.push_back(makespan * speed);
+		result.lockWaitUs += pool.GetLockWaitUs() * speed;
+
+		// Same feedback as the SendSnapshot detour
+		for (size_t i = 0; i < jobs.size(); i++)
+			costs[jobs[i].client].AddSample((float)(durations[i] / 1000000.0));
+	}
+}
+
+static void PrintMakespans(const char *name, std::vector<double> makespans, double lockWaitUs)
+{
+	if (makespans.empty())
+	{
+		printf("  %-28s no ticks\n", name);
+		return;
+	}
+
+	std::sort(makespans.begin(), makespans.end());
+
+	double sum = 0.0;
+	for (size_t i = 0; i < makespans.size(); i++)
+		sum += makespans[i];
+
+	size_t count = makespans.size();
+	printf("  %-28s mean %9.1f us  p50 %9.1f  p95 %9.1f  p99 %9.1f  max %9.1f  lock wait %9.1f us/tick\n", name,
+		sum / count, makespans[(count - 1) * 50 / 100], makespans[(count - 1) * 95 / 100],
+		makespans[(count - 1) * 99 / 100], makespans[count - 1], lockWaitUs / count);
+}
+
+static void Usage()
+{
+	fprintf(stderr, "Usage: ssf_replay <capture> [-t threads] [-s speed] [-n ticks]\n");
+	fprintf(stderr, "  -t threads   sendsnapshot workers (default: hardware threads - 1)\n");
+	fprintf(stderr, "  -s speed     divide every captured duration by this factor (default 1)\n");
+	fprintf(stderr, "  -n ticks     replay at most this many ticks (default all)\n");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		Usage();
+		return 1;
+	}
+
+	int threads = (int)std::thread::hardware_concurrency() - 1;
+	double speed = 1.0;
+	size_t maxTicks = 0;
+
+	for (int i = 2; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-t") && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+			speed = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+			maxTicks = (size_t)atol(argv[++i]);
+		else
+		{
+			Usage();
+			return 1;
+		}
+	}
+
+	if (threads < 1)
+		threads = 1;
+	if (speed <= 0.0)
+		speed = 1.0;
+
+	SSFCaptureHeader header;
+	std::vector<SSFCaptureRecord> records;
+	if (!LoadCapture(argv[1], header, records))
+		return 1;
+
+	std::vector<ReplayTick> ticks;
+	BuildTicks(records, ticks);
+	if (maxTicks && ticks.size() > maxTicks)
+		ticks.resize(maxTicks);
+
+	PrintCaptureSummary(header, records, ticks);
+
+	std::vector<double> captured;
+	for (size_t i = 0; i < ticks.size(); i++)
+	{
+		if (!ticks[i].jobs.empty())
+			captured.push_back(ticks[i].makespanUs);
+	}
+
+	printf("Send phase makespan per tick, %d workers:\n", threads);
+	PrintMakespans("captured", captured, 0.0);
+
+	ReplayPool pool(threads, speed);
+	ReplayResult result;
+
+	static const char *s_ModeNames[SSFLockMode_Count] = { "spin", "blocking" };
+
+	for (int mode = 0; mode < SSFLockMode_Count; mode++)
+	{
+		for (int order = 0; order < 2; order++)
+		{
+			char name[64];
+			snprintf(name, sizeof(name), "%s lock, %s", s_ModeNames[mode], order ? "longest first" : "slot order");
+
+			Replay(pool, ticks, (SSFLockMode)mode, order == 1, speed, result);
+			PrintMakespans(name, result.makespans, result.lockWaitUs);
+		}
+	}
+
+	return 0;
+}